@@ -1,10 +1,8 @@
-#define MINIZ_NO_STDIO
-#define MINIZ_NO_ARCHIVE_APIS
-#define MINIZ_NO_TIME
-#define MINIZ_NO_ZLIB_APIS
+#define MINIZ_HEADER_FILE_ONLY
+#define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
 
 extern "C" {
-#include "miniz.c"
+#include "../miniz.c"
 }
 
 #include <iostream>
@@ -12,6 +10,28 @@ extern "C" {
 
 #include "../psd.h"
 
+// Narrows interleaved 16 bit or float samples to 8 bit in place.
+static void samples_to_8bit(std::vector<char>& pixels, uint16_t bit_depth)
+{
+    size_t count = pixels.size()/(bit_depth/8);
+    for(size_t i = 0; i < count; i++)
+    {
+        if (bit_depth == 16)
+        {
+            uint16_t v;
+            memcpy(&v, &pixels[i*2], 2);
+            pixels[i] = v >> 8;
+        }
+        else
+        {
+            float v;
+            memcpy(&v, &pixels[i*4], 4);
+            pixels[i] = v <= 0 ? 0 : v >= 1 ? 255 : (uint8_t)(v*255 + 0.5f);
+        }
+    }
+    pixels.resize(count);
+}
+
 int main(int argc, char** argv)
 {
     if (argc < 2)
@@ -32,24 +52,30 @@ int main(int argc, char** argv)
         std::cerr << "unsupported bit depth: " << img.header.bit_depth << std::endl;
         return -1;
     }
-    std::vector<char> merged;
-    uint32_t bytes_per_pixel = img.header.bit_depth/8;
-    std::cout << bytes_per_pixel << std::endl;
-	std::cout << std::endl;
-    for(int y = 0; y < img.header.height; y++)
+    // the channel after the color ones is alpha
+    psd::PixelFormat format;
+    if (img.header.color_mode == (uint16_t)psd::ColorMode::RGB)
+        format = img.header.num_channels > 3 ? psd::PixelFormat::RGBA : psd::PixelFormat::RGB;
+    else if (img.header.color_mode == (uint16_t)psd::ColorMode::Grayscale)
+        format = img.header.num_channels > 1 ? psd::PixelFormat::GrayAlpha : psd::PixelFormat::Gray;
+    else
     {
-        for(int x = 0; x < img.header.width; x++)
-        {
-            for(int ch = 0; ch < img.header.num_channels; ch++)
-            {
-
-                merged.push_back(img.merged_image.datas[ch][y][x*bytes_per_pixel + bytes_per_pixel-1]);
-            }
-        }
+        std::cerr << "unsupported color mode: " << img.header.color_mode << std::endl;
+        return -1;
+    }
+    unsigned num_channels = psd::channel_count(format);
+    size_t stride = (size_t)img.header.width*num_channels*(img.header.bit_depth/8);
+    std::vector<char> merged(stride*img.header.height);
+    if (!img.merged_image.interleave(format, merged.data(), stride))
+    {
+        std::cerr << "cannot decode merged image" << std::endl;
+        return -1;
     }
+    if (img.header.bit_depth != 8)
+        samples_to_8bit(merged, img.header.bit_depth);
     size_t png_size;
     std::cout << merged.size() << std::endl;
-    void* buffer = tdefl_write_image_to_png_file_in_memory(merged.data(), img.header.width, img.header.height, img.header.num_channels, &png_size);
+    void* buffer = tdefl_write_image_to_png_file_in_memory(merged.data(), img.header.width, img.header.height, num_channels, &png_size);
     std::cout << png_size << std::endl;
     std::ofstream outf("x.png", std::ios::binary);
     if (!outf)
@@ -0,0 +1,174 @@
+#include "psd.h"
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+
+using namespace std;
+
+// The row decoder ImageData::read_with_method used before PackBitDecompress.
+static bool reference_decompress(const char* src, size_t src_size, std::vector<char>& uncompressed)
+{
+    uncompressed.clear();
+    for(uint32_t i = 0; i < src_size; i ++)
+    {
+        int c = src[i];
+        if (c == -128)
+            continue;
+        else if (c < 0)
+        {
+            i++;
+            for(int j = 0; j < 1-c; j++)
+                uncompressed.push_back(src[i]);
+        }
+        else
+        {
+            if (i+1 + c+1 > src_size)
+                return false;
+            uncompressed.insert(uncompressed.end(), src+i+1, src+i+1+c+1);
+            i += c+1;
+        }
+    }
+    return true;
+}
+
+// The row encoder psd::PackBitCompress used before writing into a
+// preallocated buffer.
+static size_t reference_compress(const char* input, size_t input_size, std::vector<char>& output)
+{
+    const char* input_end = input + input_size;
+    const char* it = input;
+    auto output_size_at_start = output.size();
+    std::vector<char> sequence;
+    while(it < input_end)
+    {
+        if (std::distance(it, input_end) >= 3 && *it == *(it+1) && *it == *(it+2))
+        {
+            if (!sequence.empty())
+            {
+                output.push_back((char)sequence.size()-1);
+                output.insert(output.end(), sequence.begin(), sequence.end());
+                sequence.clear();
+            }
+            int count = 0;
+            char c = *it;
+            while(it < input_end && *it == c) ++it, ++count;
+            while(count > 128)
+            {
+                count -= 128;
+                output.push_back((char)-127);
+                output.push_back(c);
+            }
+            output.push_back((char)(1-count));
+            output.push_back(c);
+        }
+        else
+        {
+            sequence.push_back(*it);
+            if (sequence.size() == 128)
+            {
+                output.push_back(127);
+                output.insert(output.end(), sequence.begin(), sequence.end());
+                sequence.clear();
+            }
+            ++it;
+        }
+    }
+    if (!sequence.empty())
+    {
+        output.push_back((char)sequence.size()-1);
+        output.insert(output.end(), sequence.begin(), sequence.end());
+    }
+    return output.size() - output_size_at_start;
+}
+
+// Rows alternate between flat runs and noise, like painted layers do.
+static std::vector<char> make_row(std::mt19937& rng, uint32_t w, int noise_percent)
+{
+    std::vector<char> row(w);
+    uint32_t x = 0;
+    while(x < w)
+    {
+        uint32_t n = std::min<uint32_t>(w - x, 1 + rng() % 200);
+        if ((int)(rng() % 100) < noise_percent)
+            for(uint32_t i = 0; i < n; i ++)
+                row[x+i] = (char)rng();
+        else
+            memset(&row[x], (char)rng(), n);
+        x += n;
+    }
+    return row;
+}
+
+template <typename F>
+static double measure(F&& f, int iterations)
+{
+    auto start = chrono::steady_clock::now();
+    for(int i = 0; i < iterations; i ++)
+        f();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int main()
+{
+    const uint32_t w = 4096, h = 256;
+    const int iterations = 20;
+    std::mt19937 rng(1);
+
+    for(int noise:{10, 50, 90})
+    {
+        std::vector<std::vector<char>> rows;
+        std::vector<char> packed, reference_packed;
+        std::vector<size_t> sizes;
+        for(uint32_t y = 0; y < h; y ++)
+        {
+            rows.push_back(make_row(rng, w, noise));
+            sizes.push_back(psd::PackBitCompress(rows.back().data(), w, packed));
+            reference_compress(rows.back().data(), w, reference_packed);
+        }
+        if (packed != reference_packed)
+        {
+            cout << "PackBitCompress output differs from the reference" << endl;
+            return 1;
+        }
+
+        std::vector<char> row(w), scratch;
+        double reference = measure([&]{
+            const char* src = packed.data();
+            for(auto size:sizes)
+            {
+                reference_decompress(src, size, scratch);
+                src += size;
+            }
+        }, iterations);
+        double fast = measure([&]{
+            const char* src = packed.data();
+            for(auto size:sizes)
+            {
+                if (!psd::PackBitDecompress(src, size, row.data(), w))
+                    abort();
+                src += size;
+            }
+        }, iterations);
+
+        std::vector<char> encoded;
+        double reference_encode = measure([&]{
+            encoded.clear();
+            for(auto& r:rows)
+                reference_compress(r.data(), w, encoded);
+        }, iterations);
+        encoded.resize(psd::PackBitCompressBound(w));
+        double fast_encode = measure([&]{
+            for(auto& r:rows)
+                psd::PackBitCompress(r.data(), w, encoded.data());
+        }, iterations);
+
+        double bytes = (double)w * h * iterations;
+        cout << "noise " << noise << "%: "
+            << "decode: reference " << bytes / reference / 1e9 << " GB/s, "
+            << "PackBitDecompress " << bytes / fast / 1e9 << " GB/s; "
+            << "encode: reference " << bytes / reference_encode / 1e9 << " GB/s, "
+            << "PackBitCompress " << bytes / fast_encode / 1e9 << " GB/s" << endl;
+    }
+    return 0;
+}
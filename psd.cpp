@@ -1,17 +1,293 @@
 #include "psd.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
 #include <sstream>
+#include <thread>
 
-#define PSD_DEBUG
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define MINIZ_HEADER_FILE_ONLY
+#define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
+extern "C" {
+#include "miniz.c"
+}
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PSD_SSE2 1
+#endif
+// SSSE3 and AVX2 code is built with target attributes and picked at run
+// time, so it does not depend on the compiler flags.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PSD_CPU_DISPATCH 1
+#endif
+
+// Builds and emits the message only if level is enabled.
+#define PSD_TRACE(level, event, message) \
+    do \
+    { \
+        if (trace_enabled(TraceLevel::level)) \
+        { \
+            std::ostringstream trace_message; \
+            trace_message << message; \
+            trace(TraceLevel::level, TraceEvent::event, trace_message.str()); \
+        } \
+    } while(0)
 
 namespace psd
 {
-    template <uint32_t padding>
-    uint32_t padded_size(uint32_t size)
+    static TraceSink trace_sink = [](TraceLevel, TraceEvent, const std::string& message) {
+        std::cerr << message << std::endl;
+    };
+    static TraceLevel trace_max_level = TraceLevel::Error;
+
+    void set_trace_sink(TraceSink sink, TraceLevel max_level)
+    {
+        trace_sink = std::move(sink);
+        trace_max_level = max_level;
+    }
+
+    bool trace_enabled(TraceLevel level)
+    {
+        return level <= trace_max_level && trace_sink;
+    }
+
+    static void trace(TraceLevel level, TraceEvent event, const std::string& message)
+    {
+        trace_sink(level, event, message);
+    }
+
+#if !PSD_BIG_ENDIAN_HOST && defined(PSD_SSE2)
+    // Swaps the bytes of each 16-bit lane.
+    static inline __m128i byteswap16x8(__m128i v)
+    {
+        return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    }
+#endif
+
+    void BEtoLE(uint16_t* data, size_t count)
+    {
+#if !PSD_BIG_ENDIAN_HOST
+        size_t i = 0;
+#ifdef PSD_SSE2
+        for(; i + 8 <= count; i += 8)
+        {
+            __m128i* p = (__m128i*)(data + i);
+            _mm_storeu_si128(p, byteswap16x8(_mm_loadu_si128(p)));
+        }
+#endif
+        for(; i < count; i++)
+            data[i] = byteswap(data[i]);
+#endif
+    }
+
+    void BEtoLE(uint32_t* data, size_t count)
+    {
+#if !PSD_BIG_ENDIAN_HOST
+        size_t i = 0;
+#ifdef PSD_SSE2
+        for(; i + 4 <= count; i += 4)
+        {
+            __m128i* p = (__m128i*)(data + i);
+            __m128i v = byteswap16x8(_mm_loadu_si128(p));
+            v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+            v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+            _mm_storeu_si128(p, v);
+        }
+#endif
+        for(; i < count; i++)
+            data[i] = byteswap(data[i]);
+#endif
+    }
+
+    void BEtoLE(uint64_t* data, size_t count)
+    {
+#if !PSD_BIG_ENDIAN_HOST
+        size_t i = 0;
+#ifdef PSD_SSE2
+        for(; i + 2 <= count; i += 2)
+        {
+            __m128i* p = (__m128i*)(data + i);
+            __m128i v = byteswap16x8(_mm_loadu_si128(p));
+            v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+            v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+            _mm_storeu_si128(p, v);
+        }
+#endif
+        for(; i < count; i++)
+            data[i] = byteswap(data[i]);
+#endif
+    }
+
+    class MappedFile
+    {
+        public:
+            MappedFile()
+                : data(nullptr), size(0)
+            {
+            }
+
+            ~MappedFile()
+            {
+#ifdef _WIN32
+                if (data)
+                    UnmapViewOfFile(data);
+#else
+                if (data)
+                    munmap((void*)data, size);
+#endif
+            }
+
+            bool open(const char* path)
+            {
+#ifdef _WIN32
+                HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+                if (file == INVALID_HANDLE_VALUE)
+                    return false;
+                LARGE_INTEGER file_size;
+                if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+                {
+                    CloseHandle(file);
+                    return false;
+                }
+                HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+                CloseHandle(file);
+                if (!mapping)
+                    return false;
+                data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle(mapping);
+                if (!data)
+                    return false;
+                size = file_size.QuadPart;
+#else
+                int fd = ::open(path, O_RDONLY);
+                if (fd < 0)
+                    return false;
+                struct stat st;
+                if (fstat(fd, &st) != 0 || st.st_size == 0)
+                {
+                    close(fd);
+                    return false;
+                }
+                void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                close(fd);
+                if (p == MAP_FAILED)
+                    return false;
+                data = (const char*)p;
+                size = st.st_size;
+#endif
+                return true;
+            }
+
+            const char* data;
+            size_t size;
+    };
+
+    ByteReader::ByteReader(std::istream& stream, size_t chunk_size)
+        : begin_(nullptr), cur_(nullptr), end_(nullptr), base_(0),
+          stream_(&stream), chunk_(chunk_size), ok_(true), psb_(false)
+    {
+        auto pos = stream.tellg();
+        base_ = pos == std::streampos(-1) ? 0 : (uint64_t)pos;
+    }
+
+    bool ByteReader::fill()
+    {
+        base_ += end_ - begin_;
+        stream_->read(chunk_.data(), chunk_.size());
+        begin_ = cur_ = chunk_.data();
+        end_ = begin_ + stream_->gcount();
+        return end_ != begin_;
+    }
+
+    bool ByteReader::read_slow(char* dst, size_t n)
+    {
+        size_t available = end_ - cur_;
+        if (available)
+            memcpy(dst, cur_, available);
+        cur_ += available;
+        dst += available;
+        n -= available;
+        if (!stream_ || !ok_)
+            return ok_ = false;
+        if (n >= chunk_.size())
+        {
+            // large payloads go straight to the destination
+            base_ += end_ - begin_;
+            begin_ = cur_ = end_ = chunk_.data();
+            stream_->read(dst, n);
+            base_ += stream_->gcount();
+            return ok_ = (size_t)stream_->gcount() == n;
+        }
+        if (!fill() || (size_t)(end_ - cur_) < n)
+            return ok_ = false;
+        memcpy(dst, cur_, n);
+        cur_ += n;
+        return true;
+    }
+
+    bool ByteReader::seek(uint64_t pos)
+    {
+        if (pos >= base_ && pos <= base_ + (end_ - begin_))
+        {
+            cur_ = begin_ + (pos - base_);
+            return true;
+        }
+        if (!stream_)
+            return ok_ = false;
+        stream_->clear();
+        stream_->seekg(pos);
+        base_ = pos;
+        begin_ = cur_ = end_ = chunk_.data();
+        return ok_ = (bool)*stream_;
+    }
+
+    bool ByteReader::read_buffer(Buffer& b, size_t n)
+    {
+        if (owner_ && (size_t)(end_ - cur_) >= n)
+        {
+            b.assign_view(cur_, n, owner_);
+            cur_ += n;
+            return true;
+        }
+        b.resize(n);
+        return read(b.mutable_data(), n);
+    }
+
+    template <uint32_t padding, typename T>
+    T padded_size(T size)
     {
         return (size + padding-1)/padding*padding;
     }
 
+    // Writes a section or channel length: 8 bytes in PSB, 4 otherwise.
+    static void write_length(std::ostream& f, uint64_t length, bool psb)
+    {
+        if (psb)
+        {
+            be<uint64_t> l = length;
+            f.write((char*)&l, 8);
+        }
+        else
+        {
+            be<uint32_t> l = length;
+            f.write((char*)&l, 4);
+        }
+    }
+
     uint32_t ImageResourceBlock::size() const
     {
         return 
@@ -21,17 +297,16 @@ namespace psd
             padded_size<2>(buffer.size());
     }
 
-    bool ImageResourceBlock::read(std::istream& stream)
+    bool ImageResourceBlock::read(ByteReader& stream)
     {
-#ifdef PSD_DEBUG
-        auto start_pos = stream.tellg();
-#endif
+        bool check_size = trace_enabled(TraceLevel::Debug);
+        std::streampos start_pos;
+        if (check_size)
+            start_pos = stream.tell();
         stream.read((char*)&signature, 4);
         if (signature != "8BIM")
         {
-#ifdef PSD_DEBUG
-            std::cout << "Invalid image resource block signature: " << std::string((char*)&signature, (char*)&signature+4) << std::endl;;
-#endif
+            PSD_TRACE(Error, ImageResource, "Invalid image resource block signature: " << (std::string)signature);
             return false;
         }
 
@@ -42,32 +317,30 @@ namespace psd
         name.resize(length);
         stream.read(&name[0], length);
         if (length % 2 == 0)
-            stream.seekg(1, std::ios::cur);
+            stream.skip(1);
 
         be<uint32_t> buffer_length;
         stream.read((char*)&buffer_length, 4);
-        buffer.resize(buffer_length);
-        stream.read(&buffer[0], buffer_length);
+        if (!stream.read_buffer(buffer, buffer_length))
+            return false;
         if (buffer_length % 2 == 1)
-            stream.seekg(1, std::ios::cur);
-#ifdef PSD_DEBUG
-        std::cout << "Block "<<image_resource_id<<" name: (" << (int)length << ")" << name << ' ' << buffer_length << ' ' << buffer.size() << ' ' << stream.tellg()-start_pos << ' ' << size() << std::endl;
-
-        if (stream.tellg() - start_pos != size())
+            stream.skip(1);
+        PSD_TRACE(Debug, ImageResource, "Block " << image_resource_id << " name: (" << (int)length << ")" << name << ' ' << buffer_length << ' ' << size());
+        if (check_size && stream.tell() - start_pos != size())
         {
-            std::cout << "size wrong" << std::endl;
+            PSD_TRACE(Error, ImageResource, "Image resource block " << image_resource_id << " size wrong");
             return false;
         }
-#endif
 
         return true;
     }
 
     bool ImageResourceBlock::write(std::ostream& stream)
     {
-#ifdef PSD_DEBUG
-        auto start_pos = stream.tellp();
-#endif
+        bool check_size = trace_enabled(TraceLevel::Debug);
+        std::streampos start_pos;
+        if (check_size)
+            start_pos = stream.tellp();
         stream.write("8BIM", 4);
         stream.write((char*)&image_resource_id, 2);
 
@@ -85,84 +358,258 @@ namespace psd
         if (buffer.size() % 2 == 1)
             stream.write(&padding, 1);
 
-#ifdef PSD_DEBUG
-        if (stream.tellp() - start_pos != size())
+        if (check_size && start_pos != std::streampos(-1) && stream.tellp() - start_pos != size())
         {
-            std::cerr << "if (stream.tellp() - start_pos != size())" << std::endl;
+            PSD_TRACE(Error, ImageResource, "Image resource block " << image_resource_id << " written with wrong size");
             return false;
         }
-#endif
 
         return true;
     }
 
+    struct ThreadPool::Impl
+    {
+        Impl()
+            : job(nullptr), count(0), next(0), active(0), generation(0), stop(false)
+        {}
+
+        void run()
+        {
+            for(size_t i; (i = next++) < count; )
+                (*job)(i);
+        }
+
+        void worker()
+        {
+            uint64_t seen = 0;
+            std::unique_lock<std::mutex> lock(mutex);
+            for(;;)
+            {
+                wake.wait(lock, [&]{ return stop || generation != seen; });
+                if (stop)
+                    return;
+                seen = generation;
+                lock.unlock();
+                run();
+                lock.lock();
+                if (--active == 0)
+                    done.notify_all();
+            }
+        }
+
+        std::vector<std::thread> workers;
+        std::mutex busy; // one parallel_for at a time
+        std::mutex mutex;
+        std::condition_variable wake, done;
+        const std::function<void(size_t)>* job;
+        size_t count;
+        std::atomic<size_t> next;
+        size_t active;
+        uint64_t generation;
+        bool stop;
+    };
+
+    ThreadPool::ThreadPool(unsigned threads)
+        : impl_(new Impl)
+    {
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        for(unsigned i = 1; i < threads; i ++)
+            impl_->workers.emplace_back([this]{ impl_->worker(); });
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(impl_->mutex);
+            impl_->stop = true;
+        }
+        impl_->wake.notify_all();
+        for(auto& t:impl_->workers)
+            t.join();
+    }
+
+    unsigned ThreadPool::size() const
+    {
+        return impl_->workers.size() + 1;
+    }
+
+    void ThreadPool::parallel_for(size_t count, const std::function<void(size_t)>& f)
+    {
+        if (impl_->workers.empty() || count <= 1)
+        {
+            for(size_t i = 0; i < count; i ++)
+                f(i);
+            return;
+        }
+        std::lock_guard<std::mutex> busy(impl_->busy);
+        std::unique_lock<std::mutex> lock(impl_->mutex);
+        impl_->job = &f;
+        impl_->count = count;
+        impl_->next = 0;
+        impl_->active = impl_->workers.size();
+        impl_->generation ++;
+        impl_->wake.notify_all();
+        lock.unlock();
+        impl_->run();
+        lock.lock();
+        impl_->done.wait(lock, [&]{ return impl_->active == 0; });
+        impl_->job = nullptr;
+    }
+
     psd::psd()
-        : valid_(false)
+        : valid_(false), scanned_(false)
     {
     }
 
-    bool psd::load(std::istream& stream)
+    bool psd::load(std::istream& stream, const LoadOptions& options)
+    {
+        ByteReader reader(stream);
+        return load(reader, options);
+    }
+
+    bool psd::load(ByteReader& stream, const LoadOptions& options)
     {
         valid_ = false;
+        scanned_ = options.skip_images;
+        bool parallel = options.threads != 1 && !options.lazy;
+        LoadOptions read_options = options;
+        if (parallel)
+            read_options.lazy = true;
         if (!read_header(stream))
             return false;
         if (!read_color_mode(stream))
             return false;
         if (!read_image_resources(stream))
             return false;
-        if (!read_layers_and_masks(stream))
+        if (!read_layers_and_masks(stream, read_options))
+            return false;
+        merged_image.color_mode = header.color_mode;
+        if (!options.skip_images &&
+            !merged_image.read(stream, header.width, header.height, header.num_channels, header.bit_depth, read_options.lazy || !options.subtree.empty()))
             return false;
-        if (!merged_image.read(stream, header.width, header.height, header.num_channels, header.bit_depth))
+        if (parallel && !options.skip_images && !decode_parallel(options))
             return false;
 
         valid_ = true;
         return true;
     }
 
-    bool psd::read_header(std::istream& f)
+    bool psd::load_mapped(const char* path, const LoadOptions& options)
+    {
+        valid_ = false;
+        auto file = std::make_shared<MappedFile>();
+        if (!file->open(path))
+        {
+            PSD_TRACE(Error, Header, "cannot map file: " << path);
+            return false;
+        }
+        const char* data = file->data;
+        size_t size = file->size;
+        ByteReader reader(data, size, std::move(file));
+        return load(reader, options);
+    }
+
+    bool psd::decode_parallel(const LoadOptions& options)
+    {
+        // with a subtree, only its layers (LayerInfo::read checked it)
+        size_t first = 0, last = layers().size();
+        if (!options.subtree.empty())
+        {
+            size_t index = layer_info.tree.find(layers(), options.subtree);
+            first = layer_info.tree.nodes[index].first;
+            last = index + 1;
+        }
+        std::vector<ImageData*> channels;
+        for(size_t i = first; i < last; i ++)
+            for(auto& id:layers()[i].channel_info_data)
+                channels.push_back(&id);
+
+        // the merged image is split by rows, layer channels run one per job
+        ThreadPool pool(options.threads);
+        if (options.subtree.empty() && !merged_image.decode(&pool))
+            return false;
+        std::atomic<bool> ok(true);
+        pool.parallel_for(channels.size(), [&](size_t i) {
+            if (!(options.tiled ? channels[i]->decode_tiled() : channels[i]->decode()))
+                ok = false;
+        });
+        if (!ok)
+            return false;
+
+        for(auto id:channels)
+            if (!id->packed.is_view())
+                id->packed.clear();
+        if (options.subtree.empty() && !merged_image.packed.is_view())
+            merged_image.packed.clear();
+        return true;
+    }
+
+    bool psd::scan(std::istream& stream)
+    {
+        LoadOptions options;
+        options.skip_images = true;
+        return load(stream, options);
+    }
+
+    bool psd::scan_mapped(const char* path)
     {
-        f.seekg(0);
-        f.read((char*)&header, sizeof(header));
+        LoadOptions options;
+        options.skip_images = true;
+        return load_mapped(path, options);
+    }
+
+    bool psd::read_header(ByteReader& f)
+    {
+        f.seek(0);
+        f.read((char*)&header.signature, 4);
+        f.read((char*)&header.version, 2);
+        f.read((char*)&header.dummy1, 2);
+        f.read((char*)&header.dummy2, 4);
+        f.read((char*)&header.num_channels, 2);
+        f.read((char*)&header.height, 4);
+        f.read((char*)&header.width, 4);
+        f.read((char*)&header.bit_depth, 2);
+        f.read((char*)&header.color_mode, 2);
 
-        if (header.signature != *(uint32_t*)"8BPS")
+        if (header.signature != "8BPS")
         {
-            std::cerr << "signature error" << std::endl;
+            PSD_TRACE(Error, Header, "signature error");
             return false;
         }
 
-        if (header.version != 1)
+        if (header.version != 1 && header.version != 2)
         {
-            std::cerr << "header version error" << std::endl;
+            PSD_TRACE(Error, Header, "header version error");
             return false;
         }
+        f.set_psb(header.version == 2);
 
-        if (header.bit_depth != 8)
+        if (header.bit_depth != 8 && header.bit_depth != 16 && header.bit_depth != 32)
         {
-            std::cerr << "Not supported bit depth: " << header.bit_depth << std::endl;
+            PSD_TRACE(Error, Header, "Not supported bit depth: " << header.bit_depth);
             return false;
         }
 
-#ifdef PSD_DEBUG
-        std::cout << "Header:" << std::endl;
-        std::cout << "\tsignature: " << std::string((char*)&header.signature, (char*)&header.signature + 4) << std::endl;
-        std::cout << "\tversion: " << header.version << std::endl;
-        std::cout << "\tnum_channels: " << header.num_channels << std::endl;
-        std::cout << "\twidth: " << header.width << std::endl;
-        std::cout << "\theight: " << header.height << std::endl;
-        std::cout << "\tbit_depth: " << header.bit_depth << std::endl;
-        std::cout << "\tcolor_mode: " << header.color_mode << std::endl;
-#endif
+        PSD_TRACE(Info, Header, "Header:"
+            << " signature: " << (std::string)header.signature
+            << " version: " << header.version
+            << " num_channels: " << header.num_channels
+            << " width: " << header.width
+            << " height: " << header.height
+            << " bit_depth: " << header.bit_depth
+            << " color_mode: " << header.color_mode);
 
         return true;
     }
 
-    bool psd::read_color_mode(std::istream& f)
+    bool psd::read_color_mode(ByteReader& f)
     {
         uint32_t count;
         f.read((char*)&count, sizeof(count));
         if (count != 0)
         {
-            std::cerr << "Not implemented color mode: " << header.color_mode;
+            PSD_TRACE(Error, Header, "Not implemented color mode: " << header.color_mode);
             return false;
         }
         return true;
@@ -173,7 +620,7 @@ namespace psd
         return padded_size<4>(1 + name.size());
     }
 
-    bool Layer::LayerBlendingRanges::read(std::istream& f)
+    bool Layer::LayerBlendingRanges::read(ByteReader& f)
     {
         be<uint32_t> size;
         f.read((char*)&size, 4);
@@ -185,9 +632,7 @@ namespace psd
     bool Layer::LayerBlendingRanges::write(std::ostream& f)
     {
         be<uint32_t> size = data.size();
-#ifdef PSD_DEBUG
-        std::cout << "Writing blending ranges (size: " << size << ")" << std::endl;
-#endif
+        PSD_TRACE(Debug, Layer, "Writing blending ranges (size: " << size << ")");
         f.write((char*)&size, 4);
         f.write(&data[0], size);
         return true;
@@ -198,7 +643,12 @@ namespace psd
         f.write((char*)&length, 4);
         if (length)
         {
-            f.write((char*)&top, 4*4+2);
+            f.write((char*)&top, 4);
+            f.write((char*)&left, 4);
+            f.write((char*)&bottom, 4);
+            f.write((char*)&right, 4);
+            f.write((char*)&default_color, 1);
+            f.write((char*)&flags, 1);
             uint32_t remaining = length - (4*4+2);
             additional_data.resize(remaining);
             f.write(&additional_data[0], remaining);
@@ -206,15 +656,18 @@ namespace psd
         return true;
     }
 
-    bool Layer::LayerMask::read(std::istream& f)
+    bool Layer::LayerMask::read(ByteReader& f)
     {
         f.read((char*)&length, 4);
-#ifdef PSD_DEBUG
-        std::cout << "Reading mask (size: " << length << ")" << std::endl;
-#endif
+        PSD_TRACE(Debug, Layer, "Reading mask (size: " << length << ")");
         if (length)
         {
-            f.read((char*)&top, 4*4+2);
+            f.read((char*)&top, 4);
+            f.read((char*)&left, 4);
+            f.read((char*)&bottom, 4);
+            f.read((char*)&right, 4);
+            f.read((char*)&default_color, 1);
+            f.read((char*)&flags, 1);
             uint32_t remaining = length - (4*4+2);
             additional_data.resize(remaining);
             f.read(&additional_data[0], remaining);
@@ -222,44 +675,61 @@ namespace psd
         return true;
     }
 
-    bool Layer::read(std::istream& f)
+    bool Layer::LayerMask::real_rect(int32_t& top, int32_t& left, int32_t& bottom, int32_t& right) const
     {
-        f.read((char*)&top, 4*4+2);
-#ifdef PSD_DEBUG
-        std::cout << '\t' << top << ' ' << left <<' ' <<bottom << ' ' << right << std::endl;
-        std::cout << "Number of channels: " << num_channels << std::endl;
-#endif
+        // real flags and background precede the rectangle
+        if (length <= 20 || additional_data.size() < 2 + 4*4)
+            return false;
+        const char* p = additional_data.data() + additional_data.size() - 4*4;
+        uint32_t v[4];
+        memcpy(v, p, sizeof(v));
+        for(auto& x:v)
+            BEtoLE(x);
+        top = v[0];
+        left = v[1];
+        bottom = v[2];
+        right = v[3];
+        return true;
+    }
+
+    bool Layer::read(ByteReader& f)
+    {
+        f.read((char*)&top, 4);
+        f.read((char*)&left, 4);
+        f.read((char*)&bottom, 4);
+        f.read((char*)&right, 4);
+        f.read((char*)&num_channels, 2);
+        PSD_TRACE(Debug, Layer, "Bounds: " << top << ' ' << left << ' ' << bottom << ' ' << right << " number of channels: " << num_channels);
         for(uint16_t i = 0; i < num_channels; i ++)
         {
-            unsigned char buffer[6];
-            f.read((char*)buffer, 6);
-            channel_infos.emplace_back(
-                (int16_t)((uint16_t)buffer[0]*256+(uint16_t)buffer[1]),
-                (uint32_t)(
-                    ((uint32_t)buffer[2]<<24)+
-                    ((uint32_t)buffer[3]<<16)+
-                    ((uint32_t)buffer[4]<<8)+
-                    ((uint32_t)buffer[5]<<0))
-                );
-        }
-        f.read((char*)&blend_signature, 4*3+4);
-#ifdef PSD_DEBUG
-        std::cout << "Blend Signature: " << std::string((char*)&blend_signature, (char*)&blend_signature+4) << std::endl;
-#endif
-        if ((*(uint32_t*)"8BIM") != blend_signature)
+            int16_t id = f.read_be<int16_t>();
+            uint64_t length = f.read_length();
+            channel_infos.emplace_back(id, length);
+        }
+        f.read((char*)&blend_signature, 4);
+        f.read((char*)&blend_key, 4);
+        f.read((char*)&opacity, 1);
+        f.read((char*)&clipping, 1);
+        f.read((char*)&bit_flags, 1);
+        f.read((char*)&dummy1, 1);
+        f.read((char*)&extra_data_length, 4);
+        if (blend_signature != "8BIM")
+        {
+            PSD_TRACE(Error, Layer, "Invalid blend signature: " << (std::string)blend_signature);
             return false;
+        }
 
-        auto extra_start_pos = f.tellg();
+        auto extra_start_pos = f.tell();
 
         if (!mask.read(f))
         {
-            std::cerr << "mask read fail" << std::endl;
+            PSD_TRACE(Error, Layer, "mask read fail");
             return false;
         }
  
         if (!blending_ranges.read(f))
         {
-            std::cerr << "blending ranges read fail" << std::endl;
+            PSD_TRACE(Error, Layer, "blending ranges read fail");
             return false;
         }
 
@@ -270,13 +740,13 @@ namespace psd
         switch(name_size%4)
         {
             case 0:
-                f.seekg(3, std::ios::cur);
+                f.skip(3);
                 break;
             case 1:
-                f.seekg(2, std::ios::cur);
+                f.skip(2);
                 break;
             case 2:
-                f.seekg(1, std::ios::cur);
+                f.skip(1);
                 break;
             case 3:
                 break;
@@ -284,31 +754,20 @@ namespace psd
         for(char c:name)
             wname += (wchar_t)c;
         utf8name = name;
-#ifdef PSD_DEBUG
-            std::cout << "ED size" << mask.size() << " + " << blending_ranges.size();
-#endif
-        while(f.tellg() - extra_start_pos < extra_data_length)
+        while(f.tell() - extra_start_pos < extra_data_length)
         {
             ExtraData ed;
             if (!ed.read(f))
             {
-                std::cerr << "fail to read ExtraData" << std::endl;
+                PSD_TRACE(Error, ExtraData, "fail to read ExtraData");
                 return false;
             }
-#ifdef PSD_DEBUG
-            std::cout << " + " << ed.size();
-#endif
+            PSD_TRACE(Debug, ExtraData, "Extra data " << (std::string)ed.key << " size " << ed.size());
             additional_extra_data.push_back(std::move(ed));
         }
-#ifdef PSD_DEBUG
-            std::cout << std::endl;
-#endif
 
         for(auto& ed:additional_extra_data)
         {
-#ifdef PSD_DEBUG
-            std::cout << '\t' << (std::string)ed.key;
-#endif
             if (ed.key == "luni")
             {
                 ed.luni_read_name(wname, utf8name);
@@ -319,41 +778,149 @@ namespace psd
             }
         }
 
-#ifdef PSD_DEBUG
-        std::cout << std::endl;
-        std::cout << "Layer " << utf8name << std::endl;
-#endif
+        PSD_TRACE(Info, Layer, "Layer " << utf8name);
 
         return true;
     }
 
-    bool ExtraData::read(std::istream& f)
+    static const ExtraData* find_extra_data(const Layer& layer, const char* key)
+    {
+        for(auto& ed:layer.additional_extra_data)
+            if (ed.key == key)
+                return &ed;
+        return nullptr;
+    }
+
+    // Section divider type (lsct or lsdk) of a layer, and the group blend
+    // mode when the divider has one.
+    static int section_type(const Layer& layer, uint32_t& blend)
+    {
+        const ExtraData* ed = find_extra_data(layer, "lsct");
+        if (!ed)
+            ed = find_extra_data(layer, "lsdk");
+        if (!ed || ed->data.size() < 4)
+            return 0;
+        uint32_t type;
+        memcpy(&type, ed->data.data(), 4);
+        BEtoLE(type);
+        if (ed->data.size() >= 12)
+        {
+            memcpy(&blend, ed->data.data() + 8, 4);
+            BEtoLE(blend);
+        }
+        return type <= 3 ? (int)type : 0;
+    }
+
+    void LayerTree::build(const std::vector<Layer>& layers)
+    {
+        nodes.assign(layers.size(), Node());
+        roots.clear();
+        // match dividers with the group records closing them; a divider
+        // points to its record through parent
+        std::vector<size_t> open_groups;
+        for(size_t i = 0; i < layers.size(); i ++)
+        {
+            Node& node = nodes[i];
+            uint32_t blend;
+            node.type = section_type(layers[i], blend);
+            node.first = i;
+            if (node.type == 3)
+            {
+                open_groups.push_back(i);
+            }
+            else if (node.type != 0)
+            {
+                if (open_groups.empty())
+                {
+                    node.type = 0;
+                    continue;
+                }
+                node.first = open_groups.back();
+                nodes[node.first].parent = i;
+                open_groups.pop_back();
+            }
+        }
+        for(size_t i:open_groups)
+            nodes[i].type = 0;
+
+        std::vector<size_t> enclosing; // records of the groups around i
+        for(size_t i = 0; i < layers.size(); i ++)
+        {
+            Node& node = nodes[i];
+            if (!enclosing.empty() && enclosing.back() == i)
+                enclosing.pop_back();
+            if (node.type == 3)
+            {
+                enclosing.push_back(node.parent);
+                continue;
+            }
+            node.parent = enclosing.empty() ? -1 : (int32_t)enclosing.back();
+            (node.parent < 0 ? roots : nodes[node.parent].children).push_back(i);
+        }
+    }
+
+    int32_t LayerTree::find(const std::vector<Layer>& layers, const std::string& path) const
+    {
+        const std::vector<size_t>* level = &roots;
+        int32_t found = -1;
+        size_t pos = 0;
+        while(pos <= path.size())
+        {
+            size_t end = std::min(path.find('/', pos), path.size());
+            found = -1;
+            for(auto it = level->rbegin(); it != level->rend(); ++ it)
+            {
+                if (layers[*it].utf8name.compare(0, std::string::npos, path, pos, end - pos) == 0)
+                {
+                    found = (int32_t)*it;
+                    break;
+                }
+            }
+            if (found < 0)
+                return -1;
+            level = &nodes[found].children;
+            pos = end + 1;
+        }
+        return found;
+    }
+
+    bool ExtraData::read(ByteReader& f)
     {
         f.read((char*)&signature, 4);
         if (signature != "8BIM" && 
             signature != "8B64")
         {
-#ifdef PSD_DEBUG
-            std::cout << "Extra data signature error at: " << f.tellg() << ' ' << (std::string)signature <<std::endl;
-#endif
+            PSD_TRACE(Error, ExtraData, "Extra data signature error at: " << f.tell() << ' ' << (std::string)signature);
             return false;
         }
 
         f.read((char*)&key, 4);
-        f.read((char*)&length, 4);
-        data.resize(length);
-        f.read(&data[0], length);
-        return true;
+        length = has_long_length(f.psb()) ? f.read_length() : f.read_be<uint32_t>();
+        return f.read_buffer(data, length);
+    }
+
+    bool ExtraData::has_long_length(bool psb) const
+    {
+        if (!psb)
+            return false;
+        static const char* const long_keys[] = {
+            "LMsk", "Lr16", "Lr32", "Layr", "Mt16", "Mt32", "Mtrn",
+            "Alph", "FMsk", "lnk2", "FEid", "FXid", "PxSD",
+        };
+        for(auto k:long_keys)
+            if (key == k)
+                return true;
+        return false;
     }
 
     void ExtraData::luni_read_name(std::wstring& wname, std::string& utf8name)
     {
-        char* p = &data[0];
-        be<uint32_t> uni_length = *(be<uint32_t>*)p;
+        const char* p = data.data();
+        be<uint32_t> uni_length = *(const be<uint32_t>*)p;
         wname.clear();
         for(uint32_t i = 0; i < uni_length; i ++)
         {
-            wname += (wchar_t)(uint16_t)*(be<uint16_t>*)(p+4+i*2);
+            wname += (wchar_t)(uint16_t)*(const be<uint16_t>*)(p+4+i*2);
         }
         utf8name.clear();
         for(auto wc : wname)
@@ -374,56 +941,46 @@ namespace psd
         }
     }
 
-    bool ExtraData::write(std::ostream& f)
+    bool ExtraData::write(std::ostream& f, bool psb)
     {
         f.write((char*)&signature, 4);
         f.write((char*)&key, 4);
-        if (data.size() % 2 == 1)
-            data.push_back(0);
-        f.write((char*)&length, 4);
-        data.resize(length);
-        f.write(&data[0], length);
+        write_length(f, length, has_long_length(psb));
+        if (data.size() != length)
+            data.resize(length);
+        f.write(data.data(), length);
         return true;
     }
 
-    bool Layer::write(std::ostream& f)
+    uint64_t Layer::record_size(bool psb)
     {
-#ifdef PSD_DEBUG
         if (num_channels != channel_infos.size())
-            std::cout << "Image channel count: " << num_channels << " -> " << channel_infos.size() << std::endl;
-#endif
+            PSD_TRACE(Debug, Layer, "Image channel count: " << num_channels << " -> " << channel_infos.size());
         num_channels = channel_infos.size();
-        f.write((char*)&top, 4*4+2);
-
-        int idx = 0;
-        for(auto& ci:channel_infos)
-        {
-            std::ostringstream image_buffer;
-            channel_info_data[idx++].write(image_buffer);
-#ifdef PSD_DEBUG
-            //std::cout << "Image channel size change: " << ci.second << " -> " << image_buffer.str().size() << std::endl;
-#endif
-            ci.second = image_buffer.str().size();
-
-            f.write((char*)&ci.first, 2);
-            f.write((char*)&ci.second, 4);
-        }
         uint32_t old_size = extra_data_length;
         extra_data_length = mask.size() + blending_ranges.size() + name_size();
-#ifdef PSD_DEBUG
-        std::cout << "Writing Layer " << old_size << " -> " << mask.size() << " + " << blending_ranges.size() << " + " << name_size();
-#endif
         for(auto& ed:additional_extra_data)
-        {
-            extra_data_length += ed.size();
-#ifdef PSD_DEBUG
-            std::cout << " + " << ed.size();
-#endif
-        }
-#ifdef PSD_DEBUG
-        std::cout << " : " << extra_data_length << std::endl;
-#endif
-        f.write((char*)&blend_signature, 4*3+4);
+            extra_data_length += ed.size(psb);
+        PSD_TRACE(Debug, Layer, "Writing Layer " << utf8name << " extra data " << old_size << " -> " << extra_data_length);
+        return 4*4+2 + (psb ? 10 : 6)*num_channels + 4*3+4 + extra_data_length;
+    }
+
+    bool Layer::write(std::ostream& f, bool psb)
+    {
+        record_size(psb);
+        f.write((char*)&top, 4);
+        f.write((char*)&left, 4);
+        f.write((char*)&bottom, 4);
+        f.write((char*)&right, 4);
+        f.write((char*)&num_channels, 2);
+        write_channel_infos(f, psb);
+        f.write((char*)&blend_signature, 4);
+        f.write((char*)&blend_key, 4);
+        f.write((char*)&opacity, 1);
+        f.write((char*)&clipping, 1);
+        f.write((char*)&bit_flags, 1);
+        f.write((char*)&dummy1, 1);
+        f.write((char*)&extra_data_length, 4);
 
         if (!mask.write(f))
             return false;
@@ -449,24 +1006,38 @@ namespace psd
         }
         for(auto& ed:additional_extra_data)
         {
-            ed.write(f);
+            ed.write(f, psb);
         }
 
         return true;
     }
 
-    bool Layer::read_images(std::istream& f)
+    bool Layer::read_images(ByteReader& f, bool lazy, uint16_t bit_depth, bool tiled)
     {
         for(auto& ci:channel_infos)
         {
             ImageData id;
-            auto pos = f.tellg();
-            id.read(f, right-left, bottom-top);
-            auto read_size = f.tellg() - pos;
+            auto pos = f.tell();
+            // the user and real user masks have their own bounds
+            int32_t real_top, real_left, real_bottom, real_right;
+            if (ci.first == -2 && mask.length)
+                id.read(f, mask.right-mask.left, mask.bottom-mask.top, lazy || tiled, bit_depth, ci.second);
+            else if (ci.first == -3 && mask.real_rect(real_top, real_left, real_bottom, real_right))
+                id.read(f, real_right-real_left, real_bottom-real_top, lazy || tiled, bit_depth, ci.second);
+            else
+                id.read(f, right-left, bottom-top, lazy || tiled, bit_depth, ci.second);
+            auto read_size = f.tell() - pos;
+            if (tiled && !lazy)
+            {
+                if (!id.decode_tiled())
+                    return false;
+                if (!id.packed.is_view())
+                    id.packed.clear();
+            }
 
             if (read_size != ci.second)
             {
-                std::cerr << "Layer read image fail" << ' ' << read_size << ' ' << ci.second << std::endl;
+                PSD_TRACE(Error, Channel, "Layer read image fail" << ' ' << read_size << ' ' << ci.second);
                 return false;
             }
             channel_info_data.push_back(std::move(id));
@@ -475,467 +1046,3244 @@ namespace psd
         return true;
     }
 
-    bool Layer::write_images(std::ostream& f)
+    void Layer::write_channel_infos(std::ostream& f, bool psb)
     {
-        for(auto& id:channel_info_data)
+        for(auto& ci:channel_infos)
         {
-            if (!id.write(f))
-                return false;
+            f.write((char*)&ci.first, 2);
+            write_length(f, ci.second, psb);
         }
-        return true;
     }
 
-    bool LayerInfo::read(std::istream& f)
+    static bool is_zip(Compression compression)
     {
-        be<uint32_t> length;
-        f.read((char*)&length, 4);
-        auto start_pos = f.tellg();
+        return compression == Compression::Zip || compression == Compression::ZipPrediction;
+    }
 
-        f.read((char*)&num_layers, 2);
-        
-        if (num_layers < 0)
+    uint64_t Layer::encode_images(ThreadPool* pool, bool psb, const SaveOptions& options)
+    {
+        for(auto& id:channel_info_data)
+            id.set_psb(psb);
+        if (pool && is_zip(options.compression))
         {
-            num_layers = -num_layers;
-            has_merged_alpha_channel = true;
+            // a deflate stream is serial; run the channels side by side
+            pool->parallel_for(channel_infos.size(), [&](size_t i) {
+                channel_infos[i].second = channel_info_data[i].encode(nullptr, options);
+            });
+        }
+        else
+        {
+            for(size_t i = 0; i < channel_infos.size(); i ++)
+                channel_infos[i].second = channel_info_data[i].encode(pool, options);
+        }
+        uint64_t size = 0;
+        for(auto& ci:channel_infos)
+            size += ci.second;
+        return size;
+    }
+
+    bool Layer::decode_images()
+    {
+        for(auto& id:channel_info_data)
+        {
+            if (!id.decode())
+                return false;
+        }
+        return true;
+    }
+
+    bool Layer::decode_region(int16_t id, int32_t left, int32_t top, uint32_t width, uint32_t height, Plane& out) const
+    {
+        for(size_t i = 0; i < channel_infos.size(); i ++)
+        {
+            if (channel_infos[i].first != id)
+                continue;
+            const ImageData& channel = channel_info_data[i];
+            size_t sample_size = channel.bit_depth/8;
+            out = Plane(width*sample_size, height);
+            // the masks are placed by their own rectangles, the other
+            // channels by the layer bounds
+            int32_t origin_left = this->left, origin_top = this->top;
+            int32_t real_bottom, real_right;
+            if (id == -2 && mask.length)
+            {
+                origin_left = mask.left;
+                origin_top = mask.top;
+            }
+            else if (id == -3)
+            {
+                mask.real_rect(origin_top, origin_left, real_bottom, real_right);
+            }
+            // clip to the channel bounds; the rest stays zero
+            int64_t x0 = std::max<int64_t>(left, origin_left);
+            int64_t y0 = std::max<int64_t>(top, origin_top);
+            int64_t x1 = std::min<int64_t>((int64_t)left + width, (int64_t)origin_left + channel.w);
+            int64_t y1 = std::min<int64_t>((int64_t)top + height, (int64_t)origin_top + channel.h);
+            if (x0 >= x1 || y0 >= y1)
+                return true;
+            char* dst = out.row(y0 - top) + (x0 - left)*sample_size;
+            return channel.decode_region(x0 - origin_left, y0 - origin_top, x1 - x0, y1 - y0, dst, out.stride());
+        }
+        return false;
+    }
+
+    bool Layer::decode_scaled(int16_t id, unsigned shift, Plane& out) const
+    {
+        for(size_t i = 0; i < channel_infos.size(); i ++)
+            if (channel_infos[i].first == id)
+                return channel_info_data[i].decode_scaled(shift, out);
+        return false;
+    }
+
+    bool Layer::write_images(std::ostream& f)
+    {
+        for(auto& id:channel_info_data)
+        {
+            if (!id.write_encoded(f))
+                return false;
+        }
+        return true;
+    }
+
+    bool LayerInfo::read(ByteReader& f, const LoadOptions& options, uint16_t bit_depth)
+    {
+        uint64_t length = f.read_length();
+        auto start_pos = f.tell();
+
+        // 16 and 32 bit documents leave this empty and keep their layers
+        // in an Lr16/Lr32 tagged block
+        if (length == 0)
+        {
+            num_layers = 0;
+            return true;
+        }
+
+        f.read((char*)&num_layers, 2);
+
+        if (num_layers < 0)
+        {
+            num_layers = -num_layers;
+            has_merged_alpha_channel = true;
         }
 
-#ifdef PSD_DEBUG
-        std::cout  << "Number of layers: " << num_layers << std::endl;
-#endif
-
+        PSD_TRACE(Info, Section, "Number of layers: " << num_layers);
+
         for(int32_t i = 0; i < num_layers; i ++)
         {
-#ifdef PSD_DEBUG
-            std::cout << "Layer " << i << ": (at " << f.tellg() << ")" << std::endl;
-#endif
+            PSD_TRACE(Debug, Layer, "Layer " << i << ": (at " << f.tell() << ")");
             Layer l;
             if (!l.read(f))
             {
-                std::cerr << "Layer read fail" << std::endl;
+                PSD_TRACE(Error, Layer, "Layer read fail");
                 return false;
             }
             layers.push_back(std::move(l));
         }
+        tree.build(layers);
 
-        for(auto& l:layers)
+        // layers outside the subtree are read as with lazy; a document
+        // over 8 bits has no layers here but in a tagged block
+        size_t first = 0, last = layers.size();
+        if (!options.subtree.empty() && !layers.empty())
         {
-            if (!l.read_images(f))
+            int32_t index = tree.find(layers, options.subtree);
+            if (index < 0)
             {
-                std::cerr << "Layer read images fail" << std::endl;
+                PSD_TRACE(Error, Layer, "No layer or group " << options.subtree);
                 return false;
             }
+            first = tree.nodes[index].first;
+            last = index + 1;
+        }
+
+        if (options.skip_images)
+        {
+            uint64_t images_size = 0;
+            for(auto& l:layers)
+                for(auto& ci:l.channel_infos)
+                    images_size += ci.second;
+            f.skip(images_size);
+        }
+        else
+        {
+            for(size_t i = 0; i < layers.size(); i ++)
+            {
+                if (!layers[i].read_images(f, options.lazy || i < first || i >= last, bit_depth, options.tiled))
+                {
+                    PSD_TRACE(Error, Layer, "Layer read images fail");
+                    return false;
+                }
+            }
+        }
+
+        // padded to an even size, or to 4 bytes inside a tagged block
+        auto diff = f.tell() - start_pos;
+        if (diff > length || length - diff > 3)
+        {
+            PSD_TRACE(Error, Section, "Layer diff fail" << diff << ' ' << length);
+            return false;
+        }
+        return f.seek(start_pos + length);
+    }
+
+    uint64_t LayerInfo::encode(ThreadPool* pool, bool psb, const SaveOptions& options)
+    {
+        uint64_t size = 2;
+        if (pool && is_zip(options.compression))
+        {
+            // spread whole layers over the pool, one deflate stream each
+            std::vector<uint64_t> sizes(layers.size());
+            pool->parallel_for(layers.size(), [&](size_t i) {
+                sizes[i] = layers[i].encode_images(nullptr, psb, options);
+            });
+            for(size_t i = 0; i < layers.size(); i ++)
+                size += layers[i].record_size(psb) + sizes[i];
+        }
+        else
+        {
+            for(auto& l:layers)
+                size += l.record_size(psb) + l.encode_images(pool, psb, options);
+        }
+        return (psb ? 8 : 4) + padded_size<2>(size);
+    }
+
+    bool LayerInfo::write_header(std::ostream& f)
+    {
+        be<int16_t> adjusted_num_layers;
+        adjusted_num_layers = num_layers;
+        if (has_merged_alpha_channel)
+            adjusted_num_layers = -(int16_t)num_layers;
+        PSD_TRACE(Debug, Section, "Writing number of layers: " << num_layers << ' ' << adjusted_num_layers);
+        f.write((char*)&adjusted_num_layers, 2);
+        return true;
+    }
+
+    bool LayerInfo::write_encoded(std::ostream& f, uint64_t size, bool psb)
+    {
+        uint64_t length = size - (psb ? 8 : 4);
+        write_length(f, length, psb);
+        write_header(f);
+        uint64_t written = 2;
+        for(auto& l:layers)
+        {
+            written += l.record_size(psb);
+            if (!l.write(f, psb))
+                return false;
+        }
+        for(auto& l:layers)
+        {
+            for(auto& ci:l.channel_infos)
+                written += ci.second;
+            if (!l.write_images(f))
+                return false;
+        }
+        // length was padded to an even size by encode
+        if (written < length)
+            f.write("", 1);
+        return true;
+    }
+
+    bool LayerInfo::write(std::ostream& f, ThreadPool* pool, bool psb, const SaveOptions& options)
+    {
+        auto length_pos = f.tellp();
+        if (length_pos == std::streampos(-1))
+        {
+            // not seekable: encode every channel up front to know the sizes
+            return write_encoded(f, encode(pool, psb, options), psb);
+        }
+
+        // Write the layer records with stale channel lengths, then encode
+        // and write one layer at a time and patch the lengths afterwards.
+        write_length(f, 0, psb);
+        write_header(f);
+        std::vector<std::streampos> channel_info_pos;
+        for(auto& l:layers)
+        {
+            channel_info_pos.push_back(f.tellp() + std::streamoff(4*4+2));
+            if (!l.write(f, psb))
+                return false;
+        }
+        for(auto& l:layers)
+        {
+            l.encode_images(pool, psb, options);
+            if (!l.write_images(f))
+                return false;
+        }
+        auto end_pos = f.tellp();
+        if ((end_pos - length_pos) % 2 == 1)
+        {
+            f.write("", 1);
+            end_pos += 1;
+        }
+
+        for(size_t i = 0; i < layers.size(); i ++)
+        {
+            f.seekp(channel_info_pos[i]);
+            layers[i].write_channel_infos(f, psb);
+        }
+        f.seekp(length_pos);
+        write_length(f, end_pos - length_pos - (psb ? 8 : 4), psb);
+        f.seekp(end_pos);
+        return (bool)f;
+    }
+
+    bool GlobalLayerMaskInfo::read(ByteReader& f)
+    {
+        f.read((char*)&length, 4);
+        if (length >= 2+2*4+2+1)
+        {
+            f.read((char*)&overlay_colorspace, 2);
+            f.read((char*)color_component, 2*4);
+            f.read((char*)&opacity, 2);
+            f.read((char*)&kind, 1);
+            uint32_t remaining = length - (2+2*4+2+1);
+            data.resize(remaining);
+            f.read(&data[0], remaining);
+        }
+        else if (length != 0)
+        {
+            PSD_TRACE(Error, Section, "Invalid GlobalLayerMaskInfo size: " << length);
+            return false;
+        }
+        return true;
+    }
+
+    bool GlobalLayerMaskInfo::write(std::ostream& f)
+    {
+        f.write((char*)&length, 4);
+        if (length)
+        {
+            f.write((char*)&overlay_colorspace, 2);
+            f.write((char*)color_component, 2*4);
+            f.write((char*)&opacity, 2);
+            f.write((char*)&kind, 1);
+            f.write((char*)&data[0], data.size());
+        }
+        return true;
+    }
+
+    // PackBits row length tables hold 2 byte entries, 4 byte ones in PSB.
+    static size_t row_table_size(uint32_t rows, bool psb)
+    {
+        return (psb ? 4 : 2)*(size_t)rows;
+    }
+
+    static uint32_t get_row_length(const char* table, uint32_t y, bool psb)
+    {
+        if (psb)
+        {
+            uint32_t length;
+            memcpy(&length, table + 4*(size_t)y, 4);
+            BEtoLE(length);
+            return length;
         }
+        uint16_t length;
+        memcpy(&length, table + 2*(size_t)y, 2);
+        BEtoLE(length);
+        return length;
+    }
 
-        auto diff = f.tellg() - start_pos;
-        if (diff != length && diff + 1 != length)
+    static void set_row_length(char* table, uint32_t y, uint32_t length, bool psb)
+    {
+        if (psb)
+        {
+            be<uint32_t> l = length;
+            memcpy(table + 4*(size_t)y, &l, 4);
+        }
+        else
         {
-            std::cerr << "Layer diff fail" << diff << ' ' << length << std::endl;
+            assert(length <= 0xffff);
+            be<uint16_t> l = length;
+            memcpy(table + 2*(size_t)y, &l, 2);
+        }
+    }
+
+    // Rewrites the row length table heading a PackBits payload of rows
+    // rows for the other format.
+    static void convert_row_table(Buffer& packed, uint32_t rows, bool psb)
+    {
+        size_t old_table = row_table_size(rows, !psb);
+        if (packed.size() < old_table)
+            return;
+        std::vector<char> output(row_table_size(rows, psb) + packed.size() - old_table);
+        for(uint32_t y = 0; y < rows; y ++)
+            set_row_length(output.data(), y, get_row_length(packed.data(), y, !psb), psb);
+        memcpy(output.data() + row_table_size(rows, psb), packed.data() + old_table, packed.size() - old_table);
+        packed.assign(std::move(output));
+    }
+
+    bool ImageData::read_with_method(ByteReader& f, uint32_t w, uint32_t h, uint16_t compression_method, bool lazy, uint16_t bit_depth, uint64_t payload_size)
+    {
+        this->w = w;
+        this->h = h;
+        this->bit_depth = bit_depth;
+        this->compression_method = compression_method;
+        psb = f.psb();
+        decoded = false;
+        data.clear();
+        if (!read_packed(f, payload_size))
+            return false;
+        if (lazy)
+            return true;
+        if (!decode())
             return false;
+        if (!packed.is_view())
+            packed.clear();
+        return true;
+    }
+
+    bool ImageData::read_packed(ByteReader& f, uint64_t payload_size)
+    {
+        switch(compression_method)
+        {
+            case 0: // RAW
+                return f.read_buffer(packed, row_bytes()*h);
+            case 1: // PackBits by line
+                {
+                    auto table_pos = f.tell();
+                    std::vector<char> table(row_table_size(h, psb));
+                    f.read(table.data(), table.size());
+                    size_t total = table.size();
+                    for(uint32_t y = 0; y < h; y ++)
+                        total += get_row_length(table.data(), y, psb);
+                    f.seek(table_pos);
+                    return f.read_buffer(packed, total);
+                }
+            case 2: // ZIP
+            case 3: // ZIP with prediction
+                if (payload_size == 0 && row_bytes()*h != 0)
+                {
+                    PSD_TRACE(Error, Channel, "ZIP data of unknown length");
+                    return false;
+                }
+                return f.read_buffer(packed, payload_size);
+            default:
+                PSD_TRACE(Error, Channel, "Not supported compression method (ImageData): " << compression_method);
+                return false;
+        }
+    }
+
+    // rows handed to one thread at a time when coding in parallel
+    static const uint32_t block_rows = 64;
+
+    // Runs decode_block(y0, y1) over [0, rows), in blocks of rows spread
+    // over pool when one is given.
+    template <typename DecodeBlock>
+    static bool for_row_blocks(uint32_t rows, ThreadPool* pool, DecodeBlock decode_block)
+    {
+        if (!pool || pool->size() == 1 || rows <= block_rows)
+            return decode_block(0, rows);
+
+        std::atomic<bool> ok(true);
+        pool->parallel_for((rows + block_rows-1)/block_rows, [&](size_t block) {
+            uint32_t y0 = block*block_rows;
+            if (!decode_block(y0, std::min(rows, y0 + block_rows)))
+                ok = false;
+        });
+        return ok;
+    }
+
+    // Converts count samples of sample_size bytes between big endian and
+    // host order in place.
+    static void swap_samples(char* p, size_t count, unsigned sample_size)
+    {
+        if (sample_size == 2)
+            BEtoLE((uint16_t*)p, count);
+        else if (sample_size == 4)
+            BEtoLE((uint32_t*)p, count);
+    }
+
+    // Returns row in file (big endian) order, converted into scratch when
+    // samples are wider than a byte.
+    static const char* file_order_row(const char* row, size_t row_bytes, unsigned sample_size, std::vector<char>& scratch)
+    {
+        if (sample_size == 1)
+            return row;
+        scratch.resize(row_bytes);
+        memcpy(scratch.data(), row, row_bytes);
+        swap_samples(scratch.data(), row_bytes/sample_size, sample_size);
+        return scratch.data();
+    }
+
+    // Undoes the byte wise delta coding of ZIP with prediction.
+    static void undo_delta8(uint8_t* p, size_t n)
+    {
+        size_t i = 0;
+        uint8_t sum = 0;
+#ifdef PSD_SSE2
+        for(; i + 16 <= n; i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+            v = _mm_add_epi8(v, _mm_slli_si128(v, 1));
+            v = _mm_add_epi8(v, _mm_slli_si128(v, 2));
+            v = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+            v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+            v = _mm_add_epi8(v, _mm_set1_epi8((char)sum));
+            _mm_storeu_si128((__m128i*)(p + i), v);
+            sum = p[i + 15];
+        }
+#endif
+        for(; i < n; i ++)
+            p[i] = sum += p[i];
+    }
+
+    // Same for 16 bit samples, already in host order.
+    static void undo_delta16(uint16_t* p, size_t n)
+    {
+        size_t i = 0;
+        uint16_t sum = 0;
+#ifdef PSD_SSE2
+        for(; i + 8 <= n; i += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+            v = _mm_add_epi16(v, _mm_slli_si128(v, 2));
+            v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+            v = _mm_add_epi16(v, _mm_slli_si128(v, 8));
+            v = _mm_add_epi16(v, _mm_set1_epi16((short)sum));
+            _mm_storeu_si128((__m128i*)(p + i), v);
+            sum = p[i + 7];
+        }
+#endif
+        for(; i < n; i ++)
+            p[i] = sum += p[i];
+    }
+
+    // Predicted 32 bit rows store the most significant bytes of all samples
+    // first, then the next bytes and so on; reassembles w host order samples
+    // from those byte planes.
+    static void merge_byte_planes(const uint8_t* src, size_t w, uint32_t* dst)
+    {
+        const uint8_t* p0 = src;
+        const uint8_t* p1 = src + w;
+        const uint8_t* p2 = src + 2*w;
+        const uint8_t* p3 = src + 3*w;
+        size_t i = 0;
+#if defined(PSD_SSE2) && !PSD_BIG_ENDIAN_HOST
+        for(; i + 16 <= w; i += 16)
+        {
+            __m128i b0 = _mm_loadu_si128((const __m128i*)(p0 + i));
+            __m128i b1 = _mm_loadu_si128((const __m128i*)(p1 + i));
+            __m128i b2 = _mm_loadu_si128((const __m128i*)(p2 + i));
+            __m128i b3 = _mm_loadu_si128((const __m128i*)(p3 + i));
+            __m128i lo = _mm_unpacklo_epi8(b3, b2);
+            __m128i hi = _mm_unpacklo_epi8(b1, b0);
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi16(lo, hi));
+            _mm_storeu_si128((__m128i*)(dst + i + 4), _mm_unpackhi_epi16(lo, hi));
+            lo = _mm_unpackhi_epi8(b3, b2);
+            hi = _mm_unpackhi_epi8(b1, b0);
+            _mm_storeu_si128((__m128i*)(dst + i + 8), _mm_unpacklo_epi16(lo, hi));
+            _mm_storeu_si128((__m128i*)(dst + i + 12), _mm_unpackhi_epi16(lo, hi));
+        }
+#endif
+        for(; i < w; i ++)
+            dst[i] = (uint32_t)p0[i] << 24 | (uint32_t)p1[i] << 16 | (uint32_t)p2[i] << 8 | p3[i];
+    }
+
+    // Delta codes n bytes of src into dst for ZIP with prediction.
+    static void delta8(const uint8_t* src, uint8_t* dst, size_t n)
+    {
+        if (n == 0)
+            return;
+        dst[0] = src[0];
+        size_t i = 1;
+#ifdef PSD_SSE2
+        for(; i + 16 <= n; i += 16)
+        {
+            __m128i cur = _mm_loadu_si128((const __m128i*)(src + i));
+            __m128i prev = _mm_loadu_si128((const __m128i*)(src + i - 1));
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_sub_epi8(cur, prev));
+        }
+#endif
+        for(; i < n; i ++)
+            dst[i] = src[i] - src[i-1];
+    }
+
+    // Same for host order 16 bit samples.
+    static void delta16(const uint16_t* src, uint16_t* dst, size_t n)
+    {
+        if (n == 0)
+            return;
+        dst[0] = src[0];
+        size_t i = 1;
+#ifdef PSD_SSE2
+        for(; i + 8 <= n; i += 8)
+        {
+            __m128i cur = _mm_loadu_si128((const __m128i*)(src + i));
+            __m128i prev = _mm_loadu_si128((const __m128i*)(src + i - 1));
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_sub_epi16(cur, prev));
         }
-        /*
-        if (f.tellg()%2 == 1)
+#endif
+        for(; i < n; i ++)
+            dst[i] = src[i] - src[i-1];
+    }
+
+    // Inverse of merge_byte_planes.
+    static void split_byte_planes(const uint32_t* src, size_t w, uint8_t* dst)
+    {
+        uint8_t* p0 = dst;
+        uint8_t* p1 = dst + w;
+        uint8_t* p2 = dst + 2*w;
+        uint8_t* p3 = dst + 3*w;
+        size_t i = 0;
+#ifdef PSD_SSE2
+        const __m128i low_byte = _mm_set1_epi32(0xff);
+        for(; i + 16 <= w; i += 16)
         {
-#ifdef PSD_DEBUG
-            std::cout << "Seek +1" << std::endl;
+            __m128i v[4];
+            for(int k = 0; k < 4; k ++)
+                v[k] = _mm_loadu_si128((const __m128i*)(src + i + 4*k));
+            uint8_t* planes[4] = {p3, p2, p1, p0};
+            for(int b = 0; b < 4; b ++)
+            {
+                // byte b of every sample, narrowed to 16 bytes
+                __m128i a0 = _mm_and_si128(_mm_srli_epi32(v[0], 8*b), low_byte);
+                __m128i a1 = _mm_and_si128(_mm_srli_epi32(v[1], 8*b), low_byte);
+                __m128i a2 = _mm_and_si128(_mm_srli_epi32(v[2], 8*b), low_byte);
+                __m128i a3 = _mm_and_si128(_mm_srli_epi32(v[3], 8*b), low_byte);
+                __m128i packed = _mm_packus_epi16(_mm_packs_epi32(a0, a1), _mm_packs_epi32(a2, a3));
+                _mm_storeu_si128((__m128i*)(planes[b] + i), packed);
+            }
+        }
 #endif
-            f.seekg(1, f.cur);
+        for(; i < w; i ++)
+        {
+            p0[i] = src[i] >> 24;
+            p1[i] = src[i] >> 16;
+            p2[i] = src[i] >> 8;
+            p3[i] = src[i];
+        }
+    }
+
+    // Turns row src of an inflated ZIP channel into host order samples at
+    // dst, undoing the prediction of method 3; src is clobbered.
+    static void unzip_row(uint16_t compression_method, char* src, size_t row_bytes, unsigned sample_size, char* dst)
+    {
+        size_t samples = row_bytes/sample_size;
+        if (compression_method == 3 && sample_size == 4)
+        {
+            undo_delta8((uint8_t*)src, row_bytes);
+            merge_byte_planes((const uint8_t*)src, samples, (uint32_t*)dst);
+            return;
         }
-        */
+        memcpy(dst, src, row_bytes);
+        swap_samples(dst, samples, sample_size);
+        if (compression_method == 3 && sample_size == 1)
+            undo_delta8((uint8_t*)dst, row_bytes);
+        else if (compression_method == 3 && sample_size == 2)
+            undo_delta16((uint16_t*)dst, samples);
+    }
+
+    // Decodes rows compressed with compression_method from packed; row_at(y)
+    // gives the destination of row y, whose samples of sample_size bytes
+    // are converted to host order. With a pool, rows are decoded in
+    // parallel; PackBits rows find their source through prefix sums over
+    // the row length table, whose entries are 4 bytes wide when psb is set.
+    template <typename RowAt>
+    static bool unpack_rows(uint16_t compression_method, const Buffer& packed, size_t row_bytes, unsigned sample_size, uint32_t rows, RowAt row_at, bool psb, ThreadPool* pool = nullptr)
+    {
+        switch(compression_method)
+        {
+            case 0: // RAW
+                {
+                    if (packed.size() < row_bytes*rows)
+                        return false;
+                    const char* src = packed.data();
+                    return for_row_blocks(rows, pool, [&](uint32_t y0, uint32_t y1) {
+                        for(uint32_t y = y0; y < y1; y ++)
+                        {
+                            memcpy(row_at(y), src + y*row_bytes, row_bytes);
+                            swap_samples(row_at(y), row_bytes/sample_size, sample_size);
+                        }
+                        return true;
+                    });
+                }
+            case 1: // PackBits by line
+                {
+                    size_t table_size = row_table_size(rows, psb);
+                    if (packed.size() < table_size)
+                        return false;
+                    const char* src = packed.data() + table_size;
+                    std::vector<size_t> offsets(rows + 1);
+                    for(uint32_t y = 0; y < rows; y++)
+                        offsets[y+1] = offsets[y] + get_row_length(packed.data(), y, psb);
+                    if (offsets[rows] > packed.size() - table_size)
+                    {
+                        PSD_TRACE(Error, Channel, "PackBit rows exceed payload");
+                        return false;
+                    }
+                    return for_row_blocks(rows, pool, [&](uint32_t y0, uint32_t y1) {
+                        for(uint32_t y = y0; y < y1; y ++)
+                        {
+                            if (!PackBitDecompress(src + offsets[y], offsets[y+1] - offsets[y], row_at(y), row_bytes))
+                            {
+                                PSD_TRACE(Error, Channel, "PackBit line " << y << " invalid");
+                                return false;
+                            }
+                            swap_samples(row_at(y), row_bytes/sample_size, sample_size);
+                        }
+                        return true;
+                    });
+                }
+            case 2: // ZIP
+            case 3: // ZIP with prediction
+                {
+                    // inflate the whole channel, then spread the rows
+                    std::vector<char> raw(row_bytes*rows);
+                    if (!raw.empty() &&
+                        tinfl_decompress_mem_to_mem(raw.data(), raw.size(), packed.data(), packed.size(), TINFL_FLAG_PARSE_ZLIB_HEADER) != raw.size())
+                    {
+                        PSD_TRACE(Error, Channel, "ZIP data invalid");
+                        return false;
+                    }
+                    return for_row_blocks(rows, pool, [&](uint32_t y0, uint32_t y1) {
+                        for(uint32_t y = y0; y < y1; y ++)
+                            unzip_row(compression_method, &raw[y*row_bytes], row_bytes, sample_size, row_at(y));
+                        return true;
+                    });
+                }
+            default:
+                PSD_TRACE(Error, Channel, "Not supported compression method (ImageData): " << compression_method);
+                return false;
+        }
+    }
+
+    // Decodes one PackBits row, keeping only the bytes [skip, skip +
+    // dst_size); the rest of the row is not read once those are filled.
+    static bool unpack_bits_range(const char* src, size_t src_size, size_t skip, char* dst, size_t dst_size)
+    {
+        const char* src_end = src + src_size;
+        char* dst_end = dst + dst_size;
+        while(src < src_end && dst < dst_end)
+        {
+            int c = (int8_t)*src++;
+            if (c >= 0)
+            {
+                size_t n = c+1;
+                if ((size_t)(src_end - src) < n)
+                    return false;
+                if (skip < n)
+                {
+                    size_t m = std::min(n - skip, (size_t)(dst_end - dst));
+                    memcpy(dst, src + skip, m);
+                    dst += m;
+                    skip = 0;
+                }
+                else
+                {
+                    skip -= n;
+                }
+                src += n;
+            }
+            else if (c != -128)
+            {
+                size_t n = 1-c;
+                if (src == src_end)
+                    return false;
+                char value = *src++;
+                if (skip < n)
+                {
+                    size_t m = std::min(n - skip, (size_t)(dst_end - dst));
+                    memset(dst, value, m);
+                    dst += m;
+                    skip = 0;
+                }
+                else
+                {
+                    skip -= n;
+                }
+            }
+        }
+        return dst == dst_end;
+    }
+
+    // Reads the rows of a channel payload (see unpack_rows) front to back,
+    // holding no more than a row, or for ZIP the inflate window, at a time.
+    // Rows come out in host order.
+    class RowStream
+    {
+        public:
+            RowStream(uint16_t compression_method, const Buffer& packed, size_t row_bytes, unsigned sample_size, uint32_t rows, bool psb)
+                : method_(compression_method), packed_(packed), row_bytes_(row_bytes), sample_size_(sample_size),
+                  rows_(rows), psb_(psb), y_(0), offset_(0), ok_(true),
+                  in_offset_(0), window_offset_(0), window_pos_(0), window_avail_(0), inflate_done_(false)
+            {
+                switch(method_)
+                {
+                    case 0: // RAW
+                        ok_ = packed.size() >= row_bytes*rows;
+                        break;
+                    case 1: // PackBits by line
+                        offset_ = row_table_size(rows, psb);
+                        ok_ = packed.size() >= offset_;
+                        break;
+                    case 2: // ZIP
+                    case 3: // ZIP with prediction
+                        tinfl_init(&inflator_);
+                        window_.resize(TINFL_LZ_DICT_SIZE);
+                        raw_.resize(row_bytes);
+                        break;
+                    default:
+                        PSD_TRACE(Error, Channel, "Not supported compression method (ImageData): " << method_);
+                        ok_ = false;
+                }
+            }
+
+            // Skips the next count rows.
+            bool skip(uint32_t count)
+            {
+                if (!ok_ || count > rows_ - y_)
+                    return false;
+                if (method_ == 1)
+                {
+                    for(uint32_t y = y_; y < y_ + count; y ++)
+                        offset_ += get_row_length(packed_.data(), y, psb_);
+                }
+                else if (method_ >= 2)
+                {
+                    if (!inflate(nullptr, row_bytes_*count))
+                        return false;
+                }
+                y_ += count;
+                return true;
+            }
+
+            // Reads bytes [x0, x0 + width_bytes) of the next row to dst.
+            // PackBits rows are only decoded up to the right edge.
+            bool read(char* dst, size_t x0, size_t width_bytes)
+            {
+                if (!ok_ || y_ == rows_)
+                    return false;
+                switch(method_)
+                {
+                    case 0:
+                        memcpy(dst, packed_.data() + y_*row_bytes_ + x0, width_bytes);
+                        swap_samples(dst, width_bytes/sample_size_, sample_size_);
+                        break;
+                    case 1:
+                        {
+                            size_t length = get_row_length(packed_.data(), y_, psb_);
+                            if (offset_ > packed_.size() || length > packed_.size() - offset_)
+                            {
+                                PSD_TRACE(Error, Channel, "PackBit rows exceed payload");
+                                return ok_ = false;
+                            }
+                            const char* src = packed_.data() + offset_;
+                            bool whole_row = x0 == 0 && width_bytes == row_bytes_;
+                            if (!(whole_row ? PackBitDecompress(src, length, dst, width_bytes) : unpack_bits_range(src, length, x0, dst, width_bytes)))
+                            {
+                                PSD_TRACE(Error, Channel, "PackBit line " << y_ << " invalid");
+                                return ok_ = false;
+                            }
+                            swap_samples(dst, width_bytes/sample_size_, sample_size_);
+                            offset_ += length;
+                        }
+                        break;
+                    default:
+                        // prediction runs along whole rows
+                        if (!inflate(raw_.data(), row_bytes_))
+                            return false;
+                        if (x0 == 0 && width_bytes == row_bytes_)
+                        {
+                            unzip_row(method_, raw_.data(), row_bytes_, sample_size_, dst);
+                        }
+                        else
+                        {
+                            row_.resize(row_bytes_);
+                            unzip_row(method_, raw_.data(), row_bytes_, sample_size_, row_.data());
+                            memcpy(dst, row_.data() + x0, width_bytes);
+                        }
+                }
+                y_ ++;
+                return true;
+            }
+
+        private:
+            // Moves the next n inflated bytes to dst, or drops them if dst
+            // is nullptr.
+            bool inflate(char* dst, size_t n)
+            {
+                while(n)
+                {
+                    if (!window_avail_)
+                    {
+                        size_t in_size = packed_.size() - in_offset_;
+                        size_t out_size = window_.size() - window_offset_;
+                        tinfl_status status = inflate_done_ ? TINFL_STATUS_DONE :
+                            tinfl_decompress(&inflator_, (const mz_uint8*)packed_.data() + in_offset_, &in_size,
+                                (mz_uint8*)window_.data(), (mz_uint8*)window_.data() + window_offset_, &out_size, TINFL_FLAG_PARSE_ZLIB_HEADER);
+                        if (inflate_done_ || (status != TINFL_STATUS_DONE && status != TINFL_STATUS_HAS_MORE_OUTPUT) || out_size == 0)
+                        {
+                            PSD_TRACE(Error, Channel, "ZIP data invalid");
+                            return ok_ = false;
+                        }
+                        in_offset_ += in_size;
+                        inflate_done_ = status == TINFL_STATUS_DONE;
+                        window_pos_ = window_offset_;
+                        window_avail_ = out_size;
+                        window_offset_ = (window_offset_ + out_size) & (TINFL_LZ_DICT_SIZE - 1);
+                    }
+                    size_t m = std::min(n, window_avail_);
+                    if (dst)
+                    {
+                        memcpy(dst, window_.data() + window_pos_, m);
+                        dst += m;
+                    }
+                    window_pos_ += m;
+                    window_avail_ -= m;
+                    n -= m;
+                }
+                return true;
+            }
+
+            uint16_t method_;
+            const Buffer& packed_;
+            size_t row_bytes_;
+            unsigned sample_size_;
+            uint32_t rows_;
+            bool psb_;
+            uint32_t y_; // next row
+            size_t offset_; // of the next PackBits row
+            bool ok_;
+
+            tinfl_decompressor inflator_;
+            std::vector<char> window_;
+            size_t in_offset_;
+            size_t window_offset_; // where tinfl writes next
+            size_t window_pos_; // first byte not yet handed out
+            size_t window_avail_;
+            bool inflate_done_;
+            std::vector<char> raw_; // inflated row
+            std::vector<char> row_; // decoded row, when cropping
+    };
+
+    // Decodes bytes [x0, x0 + width_bytes) of rows [y0, y0 + height) out of
+    // the rows coded in packed (see unpack_rows) to row_at(y - y0). PackBits
+    // rows are located through the row length table and only decoded up to
+    // the right edge; ZIP streams are inflated up to the bottom edge.
+    template <typename RowAt>
+    static bool unpack_region(uint16_t compression_method, const Buffer& packed, size_t row_bytes, unsigned sample_size, uint32_t rows,
+        uint32_t y0, uint32_t height, size_t x0, size_t width_bytes, RowAt row_at, bool psb)
+    {
+        RowStream stream(compression_method, packed, row_bytes, sample_size, rows, psb);
+        if (!stream.skip(y0))
+            return false;
+        for(uint32_t y = 0; y < height; y ++)
+        {
+            if (!stream.read(row_at(y), x0, width_bytes))
+                return false;
+        }
+        return true;
+    }
+
+    static inline void store_average(uint8_t& dst, uint64_t sum, uint64_t n) { dst = (uint8_t)((sum + n/2)/n); }
+    static inline void store_average(uint16_t& dst, uint64_t sum, uint64_t n) { dst = (uint16_t)((sum + n/2)/n); }
+    static inline void store_average(float& dst, double sum, uint64_t n) { dst = (float)(sum/n); }
+
+    // Box filters h rows of w samples of T, fetched in order with
+    // next_row(), down by 2^shift in both directions into out. Rows are
+    // summed per column in Column, which must hold 2^shift samples, and
+    // the columns of a box then in Sum. Boxes on the right and bottom
+    // edges average the samples they cover.
+    template <typename T, typename Column, typename Sum, typename NextRow>
+    static bool downscale(uint32_t w, uint32_t h, unsigned shift, NextRow next_row, Plane& out)
+    {
+        uint64_t box = (uint64_t)1 << shift;
+        uint32_t out_w = (uint32_t)((w + box - 1) >> shift);
+        uint32_t out_h = (uint32_t)((h + box - 1) >> shift);
+        out.allocate(out_w*sizeof(T), out_h);
+        std::vector<Column> columns(w);
+        for(uint32_t oy = 0; oy < out_h; oy ++)
+        {
+            std::fill(columns.begin(), columns.end(), Column());
+            uint32_t y0 = oy << shift;
+            uint32_t y1 = (uint32_t)std::min<uint64_t>(h, y0 + box);
+            for(uint32_t y = y0; y < y1; y ++)
+            {
+                const T* row = (const T*)next_row();
+                if (!row)
+                    return false;
+                Column* c = columns.data();
+                for(uint32_t x = 0; x < w; x ++)
+                    c[x] += row[x];
+            }
+            T* dst = out.row_as<T>(oy).data();
+            for(uint32_t ox = 0; ox < out_w; ox ++)
+            {
+                uint64_t x0 = (uint64_t)ox << shift;
+                uint64_t x1 = std::min<uint64_t>(w, x0 + box);
+                Sum sum = Sum();
+                for(uint64_t x = x0; x < x1; x ++)
+                    sum += columns[x];
+                store_average(dst[ox], sum, (x1 - x0)*(y1 - y0));
+            }
+        }
+        return true;
+    }
+
+    template <typename NextRow>
+    static bool downscale_samples(uint16_t bit_depth, uint32_t w, uint32_t h, unsigned shift, NextRow next_row, Plane& out)
+    {
+        if (shift >= 32)
+        {
+            PSD_TRACE(Error, Channel, "Downscale shift too large: " << shift);
+            return false;
+        }
+        switch(bit_depth)
+        {
+            case 16:
+                if (shift <= 16)
+                    return downscale<uint16_t, uint32_t, uint64_t>(w, h, shift, next_row, out);
+                return downscale<uint16_t, uint64_t, uint64_t>(w, h, shift, next_row, out);
+            case 32:
+                return downscale<float, double, double>(w, h, shift, next_row, out);
+            default:
+                if (shift <= 24)
+                    return downscale<uint8_t, uint32_t, uint64_t>(w, h, shift, next_row, out);
+                return downscale<uint8_t, uint64_t, uint64_t>(w, h, shift, next_row, out);
+        }
+    }
+
+    // Downscales rows [first_row, first_row + h) of a payload of rows rows,
+    // decoding one row at a time.
+    static bool unpack_scaled(uint16_t compression_method, const Buffer& packed, uint16_t bit_depth, uint32_t w, uint32_t h, uint32_t rows,
+        uint32_t first_row, unsigned shift, Plane& out, bool psb)
+    {
+        size_t row_bytes = (size_t)w*bit_depth/8;
+        RowStream stream(compression_method, packed, row_bytes, bit_depth/8, rows, psb);
+        if (!stream.skip(first_row))
+            return false;
+        std::vector<char> row(row_bytes);
+        return downscale_samples(bit_depth, w, h, shift, [&]() -> const char* {
+            return stream.read(row.data(), 0, row_bytes) ? row.data() : nullptr;
+        }, out);
+    }
+
+    // Whether the width x height rectangle at (left, top) lies inside w x h.
+    static bool region_inside(uint32_t left, uint32_t top, uint32_t width, uint32_t height, uint32_t w, uint32_t h)
+    {
+        return left <= w && width <= w - left && top <= h && height <= h - top;
+    }
+
+    bool ImageData::decode_region(uint32_t left, uint32_t top, uint32_t width, uint32_t height, char* dst, size_t stride) const
+    {
+        if (!region_inside(left, top, width, height, w, h))
+        {
+            PSD_TRACE(Error, Channel, "region outside of the channel");
+            return false;
+        }
+        if (width == 0 || height == 0)
+            return true;
+        unsigned sample_size = bit_depth/8;
+        size_t x0 = (size_t)left*sample_size;
+        size_t width_bytes = (size_t)width*sample_size;
+        if (decoded)
+        {
+            for(uint32_t y = 0; y < height; y ++)
+            {
+                if (tiled())
+                    tiles.read_row(top + y, left, width, dst + y*stride);
+                else
+                    memcpy(dst + y*stride, data.row(top + y) + x0, width_bytes);
+            }
+            return true;
+        }
+        return unpack_region(compression_method, packed, row_bytes(), sample_size, h, top, height, x0, width_bytes,
+            [&](uint32_t y) { return dst + y*stride; }, psb);
+    }
+
+    bool ImageData::decode_region(uint32_t left, uint32_t top, uint32_t width, uint32_t height, Plane& out) const
+    {
+        out.allocate((size_t)width*bit_depth/8, height);
+        return decode_region(left, top, width, height, out.data(), out.stride());
+    }
+
+    bool ImageData::decode_scaled(unsigned shift, Plane& out) const
+    {
+        if (decoded)
+        {
+            uint32_t y = 0;
+            std::vector<char> scratch;
+            return downscale_samples(bit_depth, w, h, shift, [&]() -> const char* { return decoded_row(y++, scratch); }, out);
+        }
+        return unpack_scaled(compression_method, packed, bit_depth, w, h, h, 0, shift, out, psb);
+    }
+
+    const uint32_t TiledPlane::tile_size;
+
+    void TiledPlane::reset(uint32_t width, uint32_t height, unsigned sample_size)
+    {
+        width_ = width;
+        height_ = height;
+        sample_size_ = sample_size;
+        tiles_x_ = (width + tile_size-1)/tile_size;
+        tiles_.clear();
+        tiles_.resize((size_t)tiles_x_*tiles_y());
+        for(auto& t:tiles_)
+            memset(t.value, 0, sizeof(t.value));
+    }
+
+    void TiledPlane::read_row(uint32_t y, uint32_t x, uint32_t count, char* dst) const
+    {
+        uint32_t ty = y/tile_size;
+        uint32_t end = x + count;
+        while(x < end)
+        {
+            uint32_t tx = x/tile_size;
+            uint32_t n = std::min(end, (tx + 1)*tile_size) - x;
+            const Tile& t = tile(tx, ty);
+            if (t.pixels.empty())
+            {
+                for(uint32_t i = 0; i < n; i ++)
+                    memcpy(dst + i*sample_size_, t.value, sample_size_);
+            }
+            else
+            {
+                memcpy(dst, tile_row(tx, ty, y%tile_size) + (x%tile_size)*sample_size_, (size_t)n*sample_size_);
+            }
+            dst += (size_t)n*sample_size_;
+            x += n;
+        }
+    }
+
+    const char* TiledPlane::segment(uint32_t tx, uint32_t y, std::vector<char>& fill) const
+    {
+        const Tile& t = tile(tx, y/tile_size);
+        if (!t.pixels.empty())
+            return tile_row(tx, y/tile_size, y%tile_size);
+        size_t bytes = (size_t)tile_size*sample_size_;
+        if (fill.size() != bytes || memcmp(fill.data(), t.value, sample_size_) != 0)
+        {
+            fill.resize(bytes);
+            for(uint32_t i = 0; i < tile_size; i ++)
+                memcpy(&fill[i*sample_size_], t.value, sample_size_);
+        }
+        return fill.data();
+    }
+
+    void TiledPlane::fill_segment(uint32_t tx, uint32_t y, const char* value)
+    {
+        Tile& t = tiles_[(size_t)(y/tile_size)*tiles_x_ + tx];
+        uint32_t ty = y%tile_size;
+        if (ty == 0 || (t.pixels.empty() && memcmp(t.value, value, sample_size_) == 0))
+        {
+            if (ty == 0)
+            {
+                t.pixels.clear();
+                memcpy(t.value, value, sample_size_);
+            }
+            return;
+        }
+        size_t row_bytes = (size_t)tile_size*sample_size_;
+        if (t.pixels.empty())
+        {
+            // no longer constant: expand the rows so far
+            t.pixels.resize(row_bytes*tile_size);
+            for(uint32_t i = 0; i < tile_size*ty; i ++)
+                memcpy(&t.pixels[i*sample_size_], t.value, sample_size_);
+        }
+        char* row = &t.pixels[ty*row_bytes];
+        for(uint32_t i = 0; i < segment_width(tx); i ++)
+            memcpy(row + i*sample_size_, value, sample_size_);
+    }
+
+    void TiledPlane::write_segment(uint32_t tx, uint32_t y, const char* samples)
+    {
+        size_t bytes = (size_t)segment_width(tx)*sample_size_;
+        // all samples equal to the next one
+        if (memcmp(samples, samples + sample_size_, bytes - sample_size_) == 0)
+        {
+            fill_segment(tx, y, samples);
+            return;
+        }
+        Tile& t = tiles_[(size_t)(y/tile_size)*tiles_x_ + tx];
+        uint32_t ty = y%tile_size;
+        size_t row_bytes = (size_t)tile_size*sample_size_;
+        if (t.pixels.empty())
+        {
+            t.pixels.resize(row_bytes*tile_size);
+            for(uint32_t i = 0; i < tile_size*ty; i ++)
+                memcpy(&t.pixels[i*sample_size_], t.value, sample_size_);
+        }
+        memcpy(&t.pixels[ty*row_bytes], samples, bytes);
+    }
+
+    void TiledPlane::write_row(uint32_t y, const char* row)
+    {
+        for(uint32_t tx = 0; tx < tiles_x_; tx ++)
+            write_segment(tx, y, row + (size_t)tx*tile_size*sample_size_);
+    }
+
+    void TiledPlane::to_plane(Plane& plane) const
+    {
+        plane.allocate((size_t)width_*sample_size_, height_);
+        for(uint32_t y = 0; y < height_; y ++)
+            read_row(y, 0, width_, plane.row(y));
+    }
+
+    size_t TiledPlane::stored_tiles() const
+    {
+        size_t n = 0;
+        for(auto& t:tiles_)
+            n += !t.pixels.empty();
+        return n;
+    }
+
+    // Decodes a PackBits row straight into row y of out. A repeat packet
+    // covering the whole part of the row in a tile becomes a constant
+    // segment without writing samples; everything else is gathered per
+    // tile in segment and converted to host order.
+    static bool unpack_bits_tiled(const char* src, size_t src_size, uint32_t y, TiledPlane& out, std::vector<char>& segment)
+    {
+        unsigned sample_size = out.sample_size();
+        size_t row_bytes = (size_t)out.width()*sample_size;
+        size_t tile_bytes = (size_t)TiledPlane::tile_size*sample_size;
+        segment.resize(tile_bytes);
+        const char* src_end = src + src_size;
+        size_t start = 0; // of the segment in the row
+        size_t filled = 0; // bytes of the segment gathered
+        char value[4];
+        auto segment_bytes = [&]() { return std::min(tile_bytes, row_bytes - start); };
+        auto next_segment = [&]() {
+            start += segment_bytes();
+            filled = 0;
+        };
+        while(src < src_end)
+        {
+            int c = (int8_t)*src++;
+            size_t n;
+            if (c >= 0)
+            {
+                n = c+1;
+                if ((size_t)(src_end - src) < n || n > row_bytes - start - filled)
+                    return false;
+                while(n)
+                {
+                    size_t m = std::min(n, segment_bytes() - filled);
+                    memcpy(&segment[filled], src, m);
+                    src += m;
+                    n -= m;
+                    filled += m;
+                    if (filled == segment_bytes())
+                    {
+                        swap_samples(segment.data(), filled/sample_size, sample_size);
+                        out.write_segment(start/tile_bytes, y, segment.data());
+                        next_segment();
+                    }
+                }
+            }
+            else if (c != -128)
+            {
+                n = 1-c;
+                if (src == src_end || n > row_bytes - start - filled)
+                    return false;
+                char v = *src++;
+                while(n)
+                {
+                    if (filled == 0 && n >= segment_bytes())
+                    {
+                        // the run covers the segment: a sample of bytes v
+                        // is the same in either byte order
+                        memset(value, v, sizeof(value));
+                        out.fill_segment(start/tile_bytes, y, value);
+                        n -= segment_bytes();
+                        next_segment();
+                        continue;
+                    }
+                    size_t m = std::min(n, segment_bytes() - filled);
+                    memset(&segment[filled], v, m);
+                    n -= m;
+                    filled += m;
+                    if (filled == segment_bytes())
+                    {
+                        swap_samples(segment.data(), filled/sample_size, sample_size);
+                        out.write_segment(start/tile_bytes, y, segment.data());
+                        next_segment();
+                    }
+                }
+            }
+        }
+        return start == row_bytes;
+    }
+
+    bool ImageData::decode_tiled()
+    {
+        if (tiled())
+            return true;
+        if (decoded)
+        {
+            tiles.reset(w, h, bit_depth/8);
+            for(uint32_t y = 0; y < h; y ++)
+                tiles.write_row(y, data.row(y));
+            data.clear();
+            return true;
+        }
+        if (packed.empty())
+            return true;
+        tiles.reset(w, h, bit_depth/8);
+        bool ok = true;
+        if (compression_method == 1)
+        {
+            size_t offset = row_table_size(h, psb);
+            std::vector<char> segment;
+            for(uint32_t y = 0; ok && y < h; y ++)
+            {
+                size_t length = get_row_length(packed.data(), y, psb);
+                ok = offset <= packed.size() && length <= packed.size() - offset &&
+                    unpack_bits_tiled(packed.data() + offset, length, y, tiles, segment);
+                if (!ok)
+                    PSD_TRACE(Error, Channel, "PackBit line " << y << " invalid");
+                offset += length;
+            }
+        }
+        else
+        {
+            RowStream stream(compression_method, packed, row_bytes(), bit_depth/8, h, psb);
+            std::vector<char> row(row_bytes());
+            for(uint32_t y = 0; ok && y < h; y ++)
+            {
+                ok = stream.read(row.data(), 0, row.size());
+                if (ok)
+                    tiles.write_row(y, row.data());
+            }
+        }
+        if (!ok)
+        {
+            tiles.clear();
+            return false;
+        }
+        decoded = true;
+        return true;
+    }
+
+    void ImageData::untile()
+    {
+        if (!tiled())
+            return;
+        tiles.to_plane(data);
+        tiles.clear();
+    }
+
+    const char* ImageData::decoded_row(uint32_t y, std::vector<char>& scratch) const
+    {
+        if (!tiled())
+            return data.row(y);
+        scratch.resize(row_bytes());
+        tiles.read_row(y, 0, w, scratch.data());
+        return scratch.data();
+    }
+
+    const char* ImageData::decoded_segment(uint32_t y, uint32_t x, std::vector<char>& fill) const
+    {
+        if (!tiled())
+            return data.row(y) + (size_t)x*(bit_depth/8);
+        return tiles.segment(x/TiledPlane::tile_size, y, fill);
+    }
+
+    bool ImageData::decode()
+    {
+        if (decoded || packed.empty())
+            return true;
+        data.allocate(row_bytes(), h);
+        if (!unpack_rows(compression_method, packed, row_bytes(), bit_depth/8, h, [this](uint32_t y) { return data.row(y); }, psb))
+        {
+            data.clear();
+            return false;
+        }
+        decoded = true;
+        return true;
+    }
+
+    bool ImageData::read(ByteReader& f, uint32_t w, uint32_t h, bool lazy, uint16_t bit_depth, uint64_t length)
+    {
+        this->w = w;
+        this->h = h;
+        f.read((char*)&compression_method, 2);
+        return read_with_method(f, w, h, compression_method, lazy, bit_depth, length > 2 ? length - 2 : 0);
+    }
+
+    bool PackBitDecompress(const char* src, size_t src_size, char* dst, size_t dst_size)
+    {
+        const char* src_end = src + src_size;
+        char* dst_end = dst + dst_size;
+        while(src < src_end)
+        {
+            int c = (int8_t)*src++;
+            if (c >= 0)
+            {
+                // literal run of c+1 bytes
+                size_t n = c+1;
+                if ((size_t)(src_end - src) < n || (size_t)(dst_end - dst) < n)
+                    return false;
+                if ((size_t)(src_end - src) >= 128 && (size_t)(dst_end - dst) >= 128)
+                {
+                    // enough slack on both sides: copy whole 16 byte blocks
+                    for(size_t i = 0; i < n; i += 16)
+                        memcpy(dst + i, src + i, 16);
+                }
+                else
+                {
+                    memcpy(dst, src, n);
+                }
+                src += n;
+                dst += n;
+            }
+            else if (c != -128)
+            {
+                // one byte repeated 1-c times
+                size_t n = 1-c;
+                if (src == src_end || (size_t)(dst_end - dst) < n)
+                    return false;
+                memset(dst, *src++, n);
+                dst += n;
+            }
+        }
+        return dst == dst_end;
+    }
+
+    static inline unsigned count_trailing_zeros(uint32_t x)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctz(x);
+#else
+        unsigned n = 0;
+        while(!(x & 1))
+            x >>= 1, n ++;
+        return n;
+#endif
+    }
+
+    // End of the run of p[i] starting at i.
+    static size_t find_run_end(const uint8_t* p, size_t i, size_t n)
+    {
+        uint8_t c = p[i++];
+#ifdef PSD_SSE2
+        __m128i v = _mm_set1_epi8((char)c);
+        for(; i + 16 <= n; i += 16)
+        {
+            uint32_t same = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), v));
+            if (same != 0xffff)
+                return i + count_trailing_zeros(~same);
+        }
+#endif
+        while(i < n && p[i] == c)
+            i ++;
+        return i;
+    }
+
+    // First position from i on where three equal bytes start, or n.
+    static size_t find_run_start(const uint8_t* p, size_t i, size_t n)
+    {
+#ifdef PSD_SSE2
+        for(; i + 18 <= n; i += 16)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(p + i + 1));
+            __m128i c = _mm_loadu_si128((const __m128i*)(p + i + 2));
+            uint32_t starts = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, b), _mm_cmpeq_epi8(b, c)));
+            if (starts)
+                return i + count_trailing_zeros(starts);
+        }
+#endif
+        for(; i + 2 < n; i ++)
+            if (p[i] == p[i+1] && p[i] == p[i+2])
+                return i;
+        return n;
+    }
+
+    size_t PackBitCompress(const char* input, size_t input_size, char* output)
+    {
+        const uint8_t* p = (const uint8_t*)input;
+        char* out = output;
+        char* out_end = output + PackBitCompressBound(input_size);
+        size_t i = 0;
+        while(i < input_size)
+        {
+            size_t run_end = find_run_end(p, i, input_size);
+            if (run_end - i >= 3)
+            {
+                // one byte repeated, at most 128 times per packet
+                size_t count = run_end - i;
+                for(; count > 128; count -= 128)
+                {
+                    *out++ = (char)-127;
+                    *out++ = (char)p[i];
+                }
+                *out++ = (char)(1-(int)count);
+                *out++ = (char)p[i];
+                i = run_end;
+                continue;
+            }
+            // literals up to the next run of three, at most 128 per packet
+            size_t literal_end = find_run_start(p, i+1, input_size);
+            while(i < literal_end)
+            {
+                size_t count = std::min<size_t>(literal_end - i, 128);
+                *out++ = (char)(count-1);
+                size_t blocks = (count + 15)/16*16;
+                if (blocks <= input_size - i && blocks <= (size_t)(out_end - out))
+                {
+                    // room on both sides: copy whole 16 byte blocks
+                    for(size_t k = 0; k < blocks; k += 16)
+                        memcpy(out + k, p + i + k, 16);
+                }
+                else
+                {
+                    memcpy(out, p + i, count);
+                }
+                out += count;
+                i += count;
+            }
+        }
+        size_t output_size = out - output;
+        assert(output_size <= PackBitCompressBound(input_size));
+        if (trace_enabled(TraceLevel::Debug))
+        {
+            // round trip check
+            std::vector<char> uncompressed(input_size);
+            bool same = PackBitDecompress(output, output_size, uncompressed.data(), input_size) &&
+                (input_size == 0 || memcmp(uncompressed.data(), input, input_size) == 0);
+            if (!same)
+                PSD_TRACE(Error, Channel, "PackBit round trip mismatch for a row of " << input_size << " bytes");
+            assert(same);
+        }
+        return output_size;
+    }
+
+    size_t PackBitCompress(const char* input, size_t input_size, std::vector<char>& output)
+    {
+        size_t start = output.size();
+        output.resize(start + PackBitCompressBound(input_size));
+        size_t size = PackBitCompress(input, input_size, output.data() + start);
+        output.resize(start + size);
+        return size;
+    }
+
+    // Compresses rows with PackBits into output as the big-endian row
+    // length table (4 byte entries when psb is set) followed by the rows.
+    // Returns false if storing the rows raw would be smaller, or if a row
+    // packs to more than the 16 bit length entries of a PSD hold; row_at(y)
+    // gives the source of row y, in host order for samples of sample_size
+    // bytes. With a pool, blocks of rows are compressed into separate
+    // buffers in parallel and appended in order.
+    template <typename RowAt>
+    static bool pack_rows(size_t row_bytes, unsigned sample_size, uint32_t rows, RowAt row_at, std::vector<char>& output, bool psb, ThreadPool* pool = nullptr)
+    {
+        uint64_t raw_size = (uint64_t)row_bytes*rows;
+        size_t table_size = row_table_size(rows, psb);
+        size_t row_bound = PackBitCompressBound(row_bytes);
+        uint64_t packed_size = 0;
+
+        if (!pool || pool->size() == 1 || rows <= block_rows)
+        {
+            // encode straight into the worst case sized output
+            output.resize(table_size + row_bound*rows);
+            char* dst = output.data() + table_size;
+            std::vector<char> scratch;
+            for(uint32_t y = 0; y < rows; y ++)
+            {
+                size_t size = PackBitCompress(file_order_row(row_at(y), row_bytes, sample_size, scratch), row_bytes, dst);
+                if (!psb && size > 0xffff)
+                    return false;
+                set_row_length(output.data(), y, size, psb);
+                dst += size;
+            }
+            packed_size = dst - output.data() - table_size;
+            output.resize(table_size + packed_size);
+        }
+        else
+        {
+            output.resize(table_size);
+            std::vector<std::vector<char>> block_output((rows + block_rows-1)/block_rows);
+            std::atomic<bool> fits(true);
+            pool->parallel_for(block_output.size(), [&](size_t block) {
+                uint32_t y0 = block*block_rows;
+                uint32_t y1 = std::min(rows, y0 + block_rows);
+                auto& b = block_output[block];
+                b.resize(row_bound*(y1 - y0));
+                char* dst = b.data();
+                std::vector<char> scratch;
+                for(uint32_t y = y0; y < y1; y ++)
+                {
+                    const char* row = file_order_row(row_at(y), row_bytes, sample_size, scratch);
+                    size_t size = PackBitCompress(row, row_bytes, dst);
+                    if (!psb && size > 0xffff)
+                    {
+                        fits = false;
+                        break;
+                    }
+                    set_row_length(output.data(), y, size, psb);
+                    dst += size;
+                }
+                b.resize(dst - b.data());
+            });
+            if (!fits)
+                return false;
+            for(auto& b:block_output)
+                packed_size += b.size();
+            output.reserve(output.size() + packed_size);
+            for(auto& b:block_output)
+                output.insert(output.end(), b.begin(), b.end());
+        }
+
+        return raw_size > packed_size + row_table_size(rows, psb);
+    }
+
+    static mz_bool append_to_vector(const void* buf, int len, void* user)
+    {
+        auto output = (std::vector<char>*)user;
+        output->insert(output->end(), (const char*)buf, (const char*)buf + len);
+        return MZ_TRUE;
+    }
+
+    // Deflates rows as a single zlib stream into output, delta coding them
+    // first when predict is set. row_at(y) gives the source of row y, in
+    // host order for samples of sample_size bytes.
+    template <typename RowAt>
+    static bool zip_rows(size_t row_bytes, unsigned sample_size, uint32_t rows, RowAt row_at, bool predict, int level, std::vector<char>& output)
+    {
+        std::vector<char> raw(row_bytes*rows);
+        std::vector<char> planes(predict && sample_size == 4 ? row_bytes : 0);
+        size_t samples = row_bytes/sample_size;
+        for(uint32_t y = 0; y < rows; y ++)
+        {
+            const char* src = row_at(y);
+            char* dst = &raw[y*row_bytes];
+            if (!predict)
+            {
+                memcpy(dst, src, row_bytes);
+                swap_samples(dst, samples, sample_size);
+            }
+            else if (sample_size == 1)
+            {
+                delta8((const uint8_t*)src, (uint8_t*)dst, row_bytes);
+            }
+            else if (sample_size == 2)
+            {
+                delta16((const uint16_t*)src, (uint16_t*)dst, samples);
+                swap_samples(dst, samples, 2);
+            }
+            else
+            {
+                split_byte_planes((const uint32_t*)src, samples, (uint8_t*)planes.data());
+                delta8((const uint8_t*)planes.data(), (uint8_t*)dst, row_bytes);
+            }
+        }
+        output.clear();
+        int flags = tdefl_create_comp_flags_from_zip_params(level, MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+        return tdefl_compress_mem_to_output(raw.data(), raw.size(), append_to_vector, &output, flags);
+    }
+
+    void ImageData::set_psb(bool psb)
+    {
+        if (!decoded && compression_method == 1 && this->psb != psb)
+            convert_row_table(packed, h, psb);
+        this->psb = psb;
+    }
+
+    uint64_t ImageData::encode(ThreadPool* pool, const SaveOptions& options)
+    {
+        if (!decoded && !packed.empty())
+        {
+            // never decoded; the original payload is still valid unless a
+            // specific method is asked for
+            if (options.compression == Compression::PackBits ||
+                compression_method == (uint16_t)options.compression || !decode())
+                return 2 + packed.size();
+        }
+
+        // tiled channels are expanded for the time of encoding
+        Plane untiled;
+        if (tiled())
+            tiles.to_plane(untiled);
+        const Plane& data = tiled() ? untiled : this->data;
+        std::vector<char> output;
+        auto row_at = [&data](uint32_t y) { return data.row(y); };
+        unsigned sample_size = bit_depth/8;
+        if (is_zip(options.compression) && zip_rows(data.row_bytes(), sample_size, data.height(), row_at,
+                    options.compression == Compression::ZipPrediction, options.zip_level, output))
+        {
+            compression_method = (uint16_t)options.compression;
+        }
+        else if (options.compression == Compression::PackBits &&
+            pack_rows(data.row_bytes(), sample_size, data.height(), row_at, output, psb, pool))
+        {
+            compression_method = 1;
+        }
+        else
+        {
+            compression_method = 0;
+            output.resize(data.row_bytes()*data.height());
+            for(uint32_t y = 0; y < data.height(); y ++)
+                memcpy(&output[y*data.row_bytes()], data.row(y), data.row_bytes());
+            swap_samples(output.data(), output.size()/sample_size, sample_size);
+        }
+        packed.assign(std::move(output));
+        decoded = true; // data is what packed now holds
+        return 2 + packed.size();
+    }
+
+    bool ImageData::write_encoded(std::ostream& f)
+    {
+        f.write((char*)&compression_method, 2);
+        f.write(packed.data(), packed.size());
+        if (decoded)
+            packed.clear(); // data stays authoritative; drop the encoded copy
+        return true;
+    }
+
+    bool ImageData::write(std::ostream& f, ThreadPool* pool)
+    {
+        encode(pool);
+        return write_encoded(f);
+    }
+
+    bool MultipleImageData::read(ByteReader& f, uint32_t w, uint32_t h, uint32_t count, uint16_t bit_depth, bool lazy)
+    {
+        this->w = w;
+        this->h = h;
+        this->count = count;
+        this->bit_depth = bit_depth;
+        psb = f.psb();
+        decoded = false;
+        datas.clear();
+        f.read((char*)&compression_method, 2);
+        ImageData imageData;
+        imageData.w = w;
+        imageData.h = h*count;
+        imageData.bit_depth = bit_depth;
+        imageData.compression_method = compression_method;
+        imageData.psb = psb;
+        if (!imageData.read_packed(f))
+        {
+            PSD_TRACE(Error, Channel, "MultipleImageData::read error");
+            return false;
+        }
+        packed = std::move(imageData.packed);
+        if (lazy)
+            return true;
+        if (!decode())
+            return false;
+        if (!packed.is_view())
+            packed.clear();
+        return true;
+    }
+
+    bool MultipleImageData::decode(ThreadPool* pool)
+    {
+        if (decoded || packed.empty())
+            return true;
+        datas.resize(count);
+        for(auto& plane:datas)
+            plane.allocate(row_bytes(), h);
+        auto row_at = [this](uint32_t row) { return datas[row/h].row(row%h); };
+        if (!unpack_rows(compression_method, packed, row_bytes(), bit_depth/8, h*count, row_at, psb, pool))
+        {
+            PSD_TRACE(Error, Channel, "MultipleImageData::decode error");
+            datas.clear();
+            return false;
+        }
+        decoded = true;
+        return true;
+    }
+
+    bool MultipleImageData::decode_region(uint32_t left, uint32_t top, uint32_t width, uint32_t height, std::vector<Plane>& out) const
+    {
+        if (!region_inside(left, top, width, height, w, h))
+        {
+            PSD_TRACE(Error, Channel, "region outside of the image");
+            return false;
+        }
+        unsigned sample_size = bit_depth/8;
+        size_t x0 = (size_t)left*sample_size;
+        size_t width_bytes = (size_t)width*sample_size;
+        out.resize(count);
+        for(uint32_t c = 0; c < count; c ++)
+        {
+            Plane& plane = out[c];
+            plane.allocate(width_bytes, height);
+            if (width == 0 || height == 0)
+                continue;
+            if (decoded)
+            {
+                for(uint32_t y = 0; y < height; y ++)
+                    memcpy(plane.row(y), datas[c].row(top + y) + x0, width_bytes);
+                continue;
+            }
+            // channels are stacked in one run of rows
+            if (!unpack_region(compression_method, packed, row_bytes(), sample_size, h*count, c*h + top, height, x0, width_bytes,
+                    [&](uint32_t y) { return plane.row(y); }, psb))
+            {
+                PSD_TRACE(Error, Channel, "MultipleImageData::decode_region error");
+                out.clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool MultipleImageData::decode_scaled(unsigned shift, std::vector<Plane>& out, ThreadPool* pool) const
+    {
+        out.resize(count);
+        std::atomic<bool> ok(true);
+        auto scale_channel = [&](size_t c) {
+            if (decoded)
+            {
+                uint32_t y = 0;
+                if (!downscale_samples(bit_depth, w, h, shift, [&]() -> const char* { return datas[c].row(y++); }, out[c]))
+                    ok = false;
+            }
+            // channels are stacked in one run of rows
+            else if (!unpack_scaled(compression_method, packed, bit_depth, w, h, h*count, c*h, shift, out[c], psb))
+            {
+                PSD_TRACE(Error, Channel, "MultipleImageData::decode_scaled error");
+                ok = false;
+            }
+        };
+        if (pool)
+            pool->parallel_for(count, scale_channel);
+        else
+            for(uint32_t c = 0; c < count; c ++)
+                scale_channel(c);
+        if (!ok)
+            out.clear();
+        return ok;
+    }
+
+    void MultipleImageData::set_psb(bool psb)
+    {
+        if (!decoded && compression_method == 1 && this->psb != psb)
+            convert_row_table(packed, h*count, psb);
+        this->psb = psb;
+    }
+
+    bool MultipleImageData::write(std::ostream& f, ThreadPool* pool)
+    {
+        if (!decoded && !packed.empty())
+        {
+            f.write((char*)&compression_method, 2);
+            f.write(packed.data(), packed.size());
+            return true;
+        }
+        if (datas.empty())
+            return false;
+        size_t row_bytes = datas[0].row_bytes();
+        unsigned sample_size = bit_depth/8;
+        uint32_t rows = h*datas.size();
+
+        auto row_at = [this](uint32_t row) { return datas[row/h].row(row%h); };
+        std::vector<char> output;
+        auto method_pos = f.tellp();
+        // rows that may pack past the 16 bit lengths of a PSD go through
+        // pack_rows below, which decides on raw up front
+        if (method_pos != std::streampos(-1) && (psb || PackBitCompressBound(row_bytes) <= 0xffff))
+        {
+            // Seekable: stream PackBits one channel at a time and patch the
+            // row length table afterwards. As soon as the total reaches the
+            // raw size, go back and write raw instead; what was written so
+            // far is smaller than that, so the result is the same as below.
+            uint64_t raw_size = (uint64_t)row_bytes*rows;
+            std::vector<char> table(row_table_size(rows, psb));
+            uint64_t size = table.size();
+            compression_method = 1;
+            f.write((char*)&compression_method, 2);
+            f.write(table.data(), table.size());
+            size_t channel_table_size = row_table_size(h, psb);
+            bool packed_smaller = true;
+            for(uint32_t ch = 0; ch < datas.size(); ch ++)
+            {
+                auto channel_row_at = [&](uint32_t y) { return datas[ch].row(y); };
+                pack_rows(row_bytes, sample_size, h, channel_row_at, output, psb, pool);
+                size += output.size() - channel_table_size;
+                if (size >= raw_size)
+                {
+                    packed_smaller = false;
+                    break;
+                }
+                memcpy(&table[ch*channel_table_size], output.data(), channel_table_size);
+                f.write(output.data() + channel_table_size, output.size() - channel_table_size);
+            }
+            if (packed_smaller)
+            {
+                auto end_pos = f.tellp();
+                f.seekp(method_pos + std::streamoff(2));
+                f.write(table.data(), table.size());
+                f.seekp(end_pos);
+                return (bool)f;
+            }
+            f.seekp(method_pos);
+        }
+        else if (pack_rows(row_bytes, sample_size, rows, row_at, output, psb, pool))
+        {
+            compression_method = 1;
+            f.write((char*)&compression_method, 2);
+            f.write(output.data(), output.size());
+            return (bool)f;
+        }
+
+        compression_method = 0;
+        f.write((char*)&compression_method, 2);
+        for(uint32_t y = 0; y < rows; y ++)
+            f.write(file_order_row(row_at(y), row_bytes, sample_size, output), row_bytes);
+        return (bool)f;
+    }
+
+    // Key of the tagged block holding the layers of documents over 8 bits.
+    static const char* layers_block_key(uint16_t bit_depth)
+    {
+        return bit_depth == 32 ? "Lr32" : "Lr16";
+    }
+
+    template <typename T>
+    static void interleave_samples(const char* const* planes, unsigned count, size_t begin, size_t w, char* dst)
+    {
+        T* out = (T*)dst;
+        for(unsigned c = 0; c < count; c ++)
+        {
+            const T* src = (const T*)planes[c];
+            for(size_t x = begin; x < w; x ++)
+                out[x*count + c] = src[x];
+        }
+    }
+
+#ifdef PSD_CPU_DISPATCH
+    // Byte j of output block k (of three 16 byte blocks) is pixel
+    // (16k + j)/3 of plane (16k + j)%3; -128 clears the byte.
+    alignas(16) static const int8_t rgb_shuffles[3][3][16] = {
+        {{0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128, -128, 5},
+         {-128, 0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128, -128},
+         {-128, -128, 0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128}},
+        {{-128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128, 10, -128},
+         {5, -128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128, 10},
+         {-128, 5, -128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128}},
+        {{-128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15, -128, -128},
+         {-128, -128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15, -128},
+         {10, -128, -128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15}},
+    };
+
+    // Interleaves whole blocks of 16 RGB pixels; returns the pixels done.
+    __attribute__((target("ssse3")))
+    static size_t interleave_rgb_ssse3(const uint8_t* const* p, size_t w, uint8_t* out)
+    {
+        __m128i shuffles[3][3];
+        for(int k = 0; k < 3; k ++)
+            for(int c = 0; c < 3; c ++)
+                shuffles[k][c] = _mm_load_si128((const __m128i*)rgb_shuffles[k][c]);
+        size_t x = 0;
+        for(; x + 16 <= w; x += 16)
+        {
+            __m128i r = _mm_loadu_si128((const __m128i*)(p[0] + x));
+            __m128i g = _mm_loadu_si128((const __m128i*)(p[1] + x));
+            __m128i b = _mm_loadu_si128((const __m128i*)(p[2] + x));
+            for(int k = 0; k < 3; k ++)
+            {
+                __m128i v = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, shuffles[k][0]), _mm_shuffle_epi8(g, shuffles[k][1])),
+                    _mm_shuffle_epi8(b, shuffles[k][2]));
+                _mm_storeu_si128((__m128i*)(out + 3*x + 16*k), v);
+            }
+        }
+        return x;
+    }
+
+    // Interleaves whole blocks of 32 RGBA pixels; returns the pixels done.
+    __attribute__((target("avx2")))
+    static size_t interleave_rgba_avx2(const uint8_t* const* p, size_t w, uint8_t* out)
+    {
+        size_t x = 0;
+        for(; x + 32 <= w; x += 32)
+        {
+            __m256i r = _mm256_loadu_si256((const __m256i*)(p[0] + x));
+            __m256i g = _mm256_loadu_si256((const __m256i*)(p[1] + x));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(p[2] + x));
+            __m256i a = _mm256_loadu_si256((const __m256i*)(p[3] + x));
+            // unpacks stay within 128 bit lanes: lane 0 holds pixels
+            // 0-15, lane 1 pixels 16-31
+            __m256i rg_lo = _mm256_unpacklo_epi8(r, g), rg_hi = _mm256_unpackhi_epi8(r, g);
+            __m256i ba_lo = _mm256_unpacklo_epi8(b, a), ba_hi = _mm256_unpackhi_epi8(b, a);
+            __m256i q0 = _mm256_unpacklo_epi16(rg_lo, ba_lo), q1 = _mm256_unpackhi_epi16(rg_lo, ba_lo);
+            __m256i q2 = _mm256_unpacklo_epi16(rg_hi, ba_hi), q3 = _mm256_unpackhi_epi16(rg_hi, ba_hi);
+            _mm256_storeu_si256((__m256i*)(out + 4*x), _mm256_permute2x128_si256(q0, q1, 0x20));
+            _mm256_storeu_si256((__m256i*)(out + 4*x + 32), _mm256_permute2x128_si256(q2, q3, 0x20));
+            _mm256_storeu_si256((__m256i*)(out + 4*x + 64), _mm256_permute2x128_si256(q0, q1, 0x31));
+            _mm256_storeu_si256((__m256i*)(out + 4*x + 96), _mm256_permute2x128_si256(q2, q3, 0x31));
+        }
+        return x;
+    }
+#endif
+
+    void interleave_row(const char* const* planes, unsigned count, size_t w, unsigned sample_size, char* dst)
+    {
+        if (count == 1)
+        {
+            memcpy(dst, planes[0], w*sample_size);
+            return;
+        }
+        if (sample_size == 2)
+            return interleave_samples<uint16_t>(planes, count, 0, w, dst);
+        if (sample_size == 4)
+            return interleave_samples<uint32_t>(planes, count, 0, w, dst);
+
+        const uint8_t* const* p = (const uint8_t* const*)planes;
+        uint8_t* out = (uint8_t*)dst;
+        size_t x = 0;
+#ifdef PSD_CPU_DISPATCH
+        static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+        static const bool has_avx2 = __builtin_cpu_supports("avx2");
+        if (count == 3 && has_ssse3)
+            x = interleave_rgb_ssse3(p, w, out);
+        else if (count == 4 && has_avx2)
+            x = interleave_rgba_avx2(p, w, out);
+#endif
+        if (count == 2)
+        {
+#ifdef PSD_SSE2
+            for(; x + 16 <= w; x += 16)
+            {
+                __m128i a = _mm_loadu_si128((const __m128i*)(p[0] + x));
+                __m128i b = _mm_loadu_si128((const __m128i*)(p[1] + x));
+                _mm_storeu_si128((__m128i*)(out + 2*x), _mm_unpacklo_epi8(a, b));
+                _mm_storeu_si128((__m128i*)(out + 2*x + 16), _mm_unpackhi_epi8(a, b));
+            }
+#endif
+        }
+        else if (count == 4)
+        {
+#ifdef PSD_SSE2
+            for(; x + 16 <= w; x += 16)
+            {
+                __m128i r = _mm_loadu_si128((const __m128i*)(p[0] + x));
+                __m128i g = _mm_loadu_si128((const __m128i*)(p[1] + x));
+                __m128i b = _mm_loadu_si128((const __m128i*)(p[2] + x));
+                __m128i a = _mm_loadu_si128((const __m128i*)(p[3] + x));
+                __m128i rg_lo = _mm_unpacklo_epi8(r, g), rg_hi = _mm_unpackhi_epi8(r, g);
+                __m128i ba_lo = _mm_unpacklo_epi8(b, a), ba_hi = _mm_unpackhi_epi8(b, a);
+                _mm_storeu_si128((__m128i*)(out + 4*x), _mm_unpacklo_epi16(rg_lo, ba_lo));
+                _mm_storeu_si128((__m128i*)(out + 4*x + 16), _mm_unpackhi_epi16(rg_lo, ba_lo));
+                _mm_storeu_si128((__m128i*)(out + 4*x + 32), _mm_unpacklo_epi16(rg_hi, ba_hi));
+                _mm_storeu_si128((__m128i*)(out + 4*x + 48), _mm_unpackhi_epi16(rg_hi, ba_hi));
+            }
+#endif
+        }
+        interleave_samples<uint8_t>(planes, count, x, w, dst);
+    }
+
+    // Fills a row of w samples of sample_size bytes with the opaque value.
+    static void fill_opaque(std::vector<char>& row, size_t w, unsigned sample_size)
+    {
+        row.resize(w*sample_size);
+        if (sample_size == 4)
+        {
+            float one = 1;
+            for(size_t x = 0; x < w; x ++)
+                memcpy(&row[x*4], &one, 4);
+        }
+        else
+        {
+            memset(row.data(), 0xff, row.size());
+        }
+    }
+
+    // Scales alpha, count samples apart, by the matching samples of mask.
+    template <typename T>
+    static void apply_mask(T* alpha, unsigned count, const T* mask, size_t w)
+    {
+        const uint32_t max = (T)~0;
+        for(size_t x = 0; x < w; x ++)
+            alpha[x*count] = (T)((alpha[x*count]*(uint32_t)mask[x] + max/2)/max);
+    }
+
+    static void apply_mask(float* alpha, unsigned count, const float* mask, size_t w)
+    {
+        for(size_t x = 0; x < w; x ++)
+            alpha[x*count] *= mask[x];
+    }
+
+    bool MultipleImageData::interleave(PixelFormat format, char* dst, size_t stride, ThreadPool* pool)
+    {
+        if (!decode(pool))
+            return false;
+        if (color_mode != (uint16_t)ColorMode::RGB && color_mode != (uint16_t)ColorMode::Grayscale)
+        {
+            PSD_TRACE(Error, Channel, "Cannot interleave color mode " << color_mode);
+            return false;
+        }
+        unsigned count = channel_count(format);
+        unsigned color = color_mode == (uint16_t)ColorMode::RGB ? 3 : 1;
+        bool has_alpha = count == 2 || count == 4;
+        if (this->count < color || (color == 3 && count < 3))
+        {
+            PSD_TRACE(Error, Channel, "Cannot interleave " << this->count << " channels into " << count);
+            return false;
+        }
+        unsigned sample_size = bit_depth/8;
+        std::vector<char> opaque;
+        if (has_alpha && this->count <= color)
+            fill_opaque(opaque, w, sample_size);
+        return for_row_blocks(h, pool, [&](uint32_t y0, uint32_t y1) {
+            for(uint32_t y = y0; y < y1; y ++)
+            {
+                // gray is repeated into RGB
+                const char* planes[4];
+                for(unsigned c = 0; c < count - has_alpha; c ++)
+                    planes[c] = datas[color == 3 ? c : 0].row(y);
+                if (has_alpha)
+                    planes[count-1] = opaque.empty() ? datas[color].row(y) : opaque.data();
+                interleave_row(planes, count, w, sample_size, dst + y*stride);
+            }
+            return true;
+        });
+    }
+
+    bool Layer::interleave(PixelFormat format, char* dst, size_t stride, bool use_mask)
+    {
+        ImageData* channels[3] = {get_channel_info_by_id(0), get_channel_info_by_id(1), get_channel_info_by_id(2)};
+        if (!channels[0])
+            return false;
+        unsigned count = channel_count(format);
+        unsigned color = channels[1] && channels[2] ? 3 : 1;
+        bool has_alpha = count == 2 || count == 4;
+        if (color == 3 && count < 3)
+        {
+            PSD_TRACE(Error, Channel, "Cannot interleave color layer into " << count << " channels");
+            return false;
+        }
+        uint32_t w = channels[0]->w;
+        uint32_t h = channels[0]->h;
+        uint16_t bit_depth = channels[0]->bit_depth;
+        unsigned sample_size = bit_depth/8;
+        ImageData* alpha = has_alpha ? get_channel_info_by_id(-1) : nullptr;
+        // the user mask (-2) covers its own rectangle and is
+        // mask.default_color everywhere else
+        ImageData* user_mask = has_alpha && use_mask && mask.length && !(mask.flags & 2) ? get_channel_info_by_id(-2) : nullptr;
+        for(int c = 0; c < 3; c ++)
+            if (channels[c] && (channels[c]->w != w || channels[c]->h != h || channels[c]->bit_depth != bit_depth))
+                return false;
+        if (alpha && (alpha->w != w || alpha->h != h || alpha->bit_depth != bit_depth))
+            return false;
+
+        std::vector<char> opaque;
+        if (has_alpha && !alpha)
+            fill_opaque(opaque, w, sample_size);
+        std::vector<char> mask_row;
+        char mask_default[4];
+        if (user_mask)
+        {
+            mask_row.resize(w*sample_size);
+            if (bit_depth == 32)
+            {
+                float value = mask.default_color/255.0f;
+                memcpy(mask_default, &value, 4);
+            }
+            else
+            {
+                memset(mask_default, mask.default_color, sample_size);
+            }
+        }
+        int64_t mask_dx = (int64_t)(int32_t)left - (int32_t)mask.left;
+        int64_t mask_dy = (int64_t)(int32_t)top - (int32_t)mask.top;
+        // tiled channels are interleaved a tile at a time straight from
+        // their stored tiles; constant tiles are filled here
+        bool tiled = channels[0]->tiled() || (channels[1] && channels[1]->tiled()) ||
+            (channels[2] && channels[2]->tiled()) || (alpha && alpha->tiled());
+        uint32_t step = tiled ? TiledPlane::tile_size : std::max(w, 1u);
+        std::vector<char> scratch[5];
+        for(uint32_t y = 0; y < h; y ++)
+        {
+            char* out = dst + y*stride;
+            for(uint32_t x = 0; x < w; x += step)
+            {
+                const char* planes[4];
+                for(unsigned c = 0; c < count - has_alpha; c ++)
+                    planes[c] = channels[color == 3 ? c : 0]->decoded_segment(y, x, scratch[c]);
+                if (has_alpha)
+                    planes[count-1] = alpha ? alpha->decoded_segment(y, x, scratch[3]) : opaque.data();
+                interleave_row(planes, count, std::min(step, w - x), sample_size, out + (size_t)x*count*sample_size);
+            }
+            if (!user_mask)
+                continue;
+
+            // the mask in layer coordinates
+            int64_t my = y + mask_dy;
+            const char* mask_src = my >= 0 && my < user_mask->h ? user_mask->decoded_row(my, scratch[4]) : nullptr;
+            for(uint32_t x = 0; x < w; x ++)
+            {
+                int64_t mx = x + mask_dx;
+                bool inside = mask_src && mx >= 0 && mx < user_mask->w;
+                memcpy(&mask_row[x*sample_size], inside ? mask_src + mx*sample_size : mask_default, sample_size);
+            }
+            char* out_alpha = out + (count-1)*sample_size;
+            if (bit_depth == 16)
+                apply_mask((uint16_t*)out_alpha, count, (const uint16_t*)mask_row.data(), w);
+            else if (bit_depth == 32)
+                apply_mask((float*)out_alpha, count, (const float*)mask_row.data(), w);
+            else
+                apply_mask((uint8_t*)out_alpha, count, (const uint8_t*)mask_row.data(), w);
+        }
+        return true;
+    }
+
+    // Blend mode and section divider keys as stored, read big endian.
+    static constexpr uint32_t fourcc(const char (&s)[5])
+    {
+        return (uint32_t)(uint8_t)s[0] << 24 | (uint32_t)(uint8_t)s[1] << 16 | (uint32_t)(uint8_t)s[2] << 8 | (uint32_t)(uint8_t)s[3];
+    }
+
+    // A layer as seen by the compositor, with its channels decoded.
+    struct CompositeLayer
+    {
+        int type; // section divider type: 0 pixels, 1 and 2 group, 3 group start
+        size_t group_end; // for a group start, the index of its group record
+        bool visible;
+        bool clipped;
+        uint32_t blend;
+        float opacity; // opacity times fill opacity
+        int32_t left, top, right, bottom;
+        const ImageData* color[3]; // green and blue are null for gray
+        const ImageData* alpha;
+        const ImageData* mask;
+        int32_t mask_left, mask_top;
+        uint32_t mask_width, mask_height;
+        float mask_default;
+        uint16_t bit_depth;
+    };
+
+    // Straight alpha RGBA of a tile as four float planes.
+    struct TilePixels
+    {
+        explicit TilePixels(size_t pixels)
+            : pixels(pixels), values(4*pixels)
+        {}
+        float* channel(int c) { return values.data() + c*pixels; }
+        const float* channel(int c) const { return values.data() + c*pixels; }
+        void clear() { std::fill(values.begin(), values.end(), 0.0f); }
+        size_t pixels;
+        std::vector<float> values;
+    };
+
+    struct Tile
+    {
+        int32_t left, top;
+        uint32_t width, height;
+        size_t pixels() const { return (size_t)width*height; }
+    };
+
+    // Buffers reused while compositing one tile.
+    class TileScratch
+    {
+        public:
+            explicit TileScratch(size_t pixels)
+                : pixels_(pixels)
+            {}
+
+            // contents are left as they were
+            TilePixels* acquire()
+            {
+                if (free_.empty())
+                    return new TilePixels(pixels_);
+                TilePixels* p = free_.back().release();
+                free_.pop_back();
+                return p;
+            }
+
+            void release(TilePixels* p)
+            {
+                free_.emplace_back(p);
+            }
+
+            std::vector<float> blend;
+
+        private:
+            size_t pixels_;
+            std::vector<std::unique_ptr<TilePixels>> free_;
+    };
+
+    // Scoped TileScratch::acquire.
+    class ScratchPixels
+    {
+        public:
+            explicit ScratchPixels(TileScratch& scratch)
+                : scratch_(scratch), pixels_(scratch.acquire())
+            {}
+            ~ScratchPixels() { scratch_.release(pixels_); }
+            TilePixels& operator * () { return *pixels_; }
+            TilePixels* operator -> () { return pixels_; }
+
+        private:
+            ScratchPixels(const ScratchPixels&) = delete;
+            ScratchPixels& operator = (const ScratchPixels&) = delete;
+
+            TileScratch& scratch_;
+            TilePixels* pixels_;
+    };
+
+    // Converts n samples of bit_depth to floats in [0, 1].
+    static void samples_to_float(const char* src, uint16_t bit_depth, size_t n, float* dst)
+    {
+        size_t i = 0;
+        switch(bit_depth)
+        {
+            case 16:
+                {
+                    const uint16_t* s = (const uint16_t*)src;
+#ifdef PSD_SSE2
+                    const __m128i zero = _mm_setzero_si128();
+                    const __m128 scale = _mm_set1_ps(1.0f/65535);
+                    for(; i + 8 <= n; i += 8)
+                    {
+                        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+                        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)), scale));
+                        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)), scale));
+                    }
+#endif
+                    for(; i < n; i ++)
+                        dst[i] = s[i]*(1.0f/65535);
+                }
+                break;
+            case 32:
+                memcpy(dst, src, n*4);
+                break;
+            default:
+                {
+                    const uint8_t* s = (const uint8_t*)src;
+#ifdef PSD_SSE2
+                    const __m128i zero = _mm_setzero_si128();
+                    const __m128 scale = _mm_set1_ps(1.0f/255);
+                    for(; i + 16 <= n; i += 16)
+                    {
+                        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+                        __m128i lo = _mm_unpacklo_epi8(v, zero);
+                        __m128i hi = _mm_unpackhi_epi8(v, zero);
+                        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), scale));
+                        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), scale));
+                        _mm_storeu_ps(dst + i + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), scale));
+                        _mm_storeu_ps(dst + i + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), scale));
+                    }
+#endif
+                    for(; i < n; i ++)
+                        dst[i] = s[i]*(1.0f/255);
+                }
+        }
+    }
+
+    // Converts count samples of row y of a channel from x on; constant
+    // tiles are converted once.
+    static void channel_to_float(const ImageData& id, uint32_t y, uint32_t x, uint32_t count, float* dst)
+    {
+        size_t sample_size = id.bit_depth/8;
+        if (!id.tiled())
+        {
+            samples_to_float(id.data.row(y) + x*sample_size, id.bit_depth, count, dst);
+            return;
+        }
+        const TiledPlane& tiles = id.tiles;
+        uint32_t ty = y/TiledPlane::tile_size;
+        uint32_t end = x + count;
+        while(x < end)
+        {
+            uint32_t tx = x/TiledPlane::tile_size;
+            uint32_t n = std::min(end, (tx + 1)*TiledPlane::tile_size) - x;
+            if (tiles.is_constant(tx, ty))
+            {
+                float v;
+                samples_to_float(tiles.value(tx, ty), id.bit_depth, 1, &v);
+                std::fill(dst, dst + n, v);
+            }
+            else
+            {
+                samples_to_float(tiles.tile_row(tx, ty, y%TiledPlane::tile_size) + (x%TiledPlane::tile_size)*sample_size, id.bit_depth, n, dst);
+            }
+            dst += n;
+            x += n;
+        }
+    }
+
+    // Whether the samples of a tiled channel in [x0, x1) x [y0, y1) all
+    // lie in constant zero tiles.
+    static bool is_transparent(const ImageData& id, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)
+    {
+        if (!id.tiled())
+            return false;
+        static const char zero[4] = {};
+        const TiledPlane& tiles = id.tiles;
+        for(uint32_t ty = y0/TiledPlane::tile_size; ty <= (y1 - 1)/TiledPlane::tile_size; ty ++)
+            for(uint32_t tx = x0/TiledPlane::tile_size; tx <= (x1 - 1)/TiledPlane::tile_size; tx ++)
+                if (!tiles.is_constant(tx, ty) || memcmp(tiles.value(tx, ty), zero, tiles.sample_size()) != 0)
+                    return false;
+        return true;
+    }
+
+    // Multiplies the alpha of tile pixels by the user mask of layer.
+    static void apply_layer_mask(const CompositeLayer& layer, const Tile& tile, float* alpha)
+    {
+        std::vector<float> row(tile.width);
+        for(uint32_t y = 0; y < tile.height; y ++)
+        {
+            int64_t my = (int64_t)tile.top + y - layer.mask_top;
+            std::fill(row.begin(), row.end(), layer.mask_default);
+            if (my >= 0 && my < layer.mask_height)
+            {
+                int64_t x0 = std::max<int64_t>(tile.left, layer.mask_left);
+                int64_t x1 = std::min<int64_t>((int64_t)tile.left + tile.width, (int64_t)layer.mask_left + layer.mask_width);
+                if (x0 < x1)
+                    channel_to_float(*layer.mask, my, x0 - layer.mask_left, x1 - x0, &row[x0 - tile.left]);
+            }
+            float* a = alpha + (size_t)y*tile.width;
+            for(uint32_t x = 0; x < tile.width; x ++)
+                a[x] *= row[x];
+        }
+    }
+
+    // Fills out with the pixels of layer inside tile, transparent around
+    // them; false if the layer does not touch the tile or is transparent
+    // there.
+    static bool fetch_layer(const CompositeLayer& layer, const Tile& tile, TilePixels& out)
+    {
+        int64_t x0 = std::max<int64_t>(tile.left, layer.left);
+        int64_t y0 = std::max<int64_t>(tile.top, layer.top);
+        int64_t x1 = std::min<int64_t>((int64_t)tile.left + tile.width, layer.right);
+        int64_t y1 = std::min<int64_t>((int64_t)tile.top + tile.height, layer.bottom);
+        if (x0 >= x1 || y0 >= y1 || !layer.color[0])
+            return false;
+        uint32_t offset = x0 - layer.left;
+        if (layer.alpha && is_transparent(*layer.alpha, offset, y0 - layer.top, x1 - layer.left, y1 - layer.top))
+            return false;
+        if (x1 - x0 != tile.width || y1 - y0 != tile.height)
+            out.clear();
+        for(int64_t y = y0; y < y1; y ++)
+        {
+            size_t at = (size_t)(y - tile.top)*tile.width + (x0 - tile.left);
+            for(int c = 0; c < 3; c ++)
+            {
+                const ImageData* id = layer.color[c] ? layer.color[c] : layer.color[0];
+                channel_to_float(*id, y - layer.top, offset, x1 - x0, out.channel(c) + at);
+            }
+            if (layer.alpha)
+                channel_to_float(*layer.alpha, y - layer.top, offset, x1 - x0, out.channel(3) + at);
+            else
+                std::fill(out.channel(3) + at, out.channel(3) + at + (x1 - x0), 1.0f);
+        }
+        if (layer.mask)
+            apply_layer_mask(layer, tile, out.channel(3));
+        return true;
+    }
+
+    template <typename F>
+    static void blend_channel(const float* cb, const float* cs, float* out, size_t n, F f)
+    {
+        for(size_t i = 0; i < n; i ++)
+            out[i] = f(cb[i], cs[i]);
+    }
 
-        return true;
+    static inline float screen(float b, float s) { return b + s - b*s; }
+    static inline float hard_light(float b, float s) { return s <= 0.5f ? b*2*s : screen(b, 2*s - 1); }
+    static inline float color_dodge(float b, float s) { return b <= 0 ? 0 : s >= 1 ? 1 : std::min(1.0f, b/(1 - s)); }
+    static inline float color_burn(float b, float s) { return b >= 1 ? 1 : s <= 0 ? 0 : 1 - std::min(1.0f, (1 - b)/s); }
+    static inline float soft_light(float b, float s)
+    {
+        if (s <= 0.5f)
+            return b - (1 - 2*s)*b*(1 - b);
+        float d = b <= 0.25f ? ((16*b - 12)*b + 4)*b : std::sqrt(b);
+        return b + (2*s - 1)*(d - b);
     }
+    static inline float vivid_light(float b, float s) { return s <= 0.5f ? color_burn(b, 2*s) : color_dodge(b, 2*s - 1); }
+    static inline float clamp01(float v) { return std::min(1.0f, std::max(0.0f, v)); }
+
+    static inline float luminosity(float r, float g, float b) { return 0.3f*r + 0.59f*g + 0.11f*b; }
 
-    bool LayerInfo::write(std::ostream& f)
+    // SetLum and SetSat of the W3C compositing spec, on c[3].
+    static void set_luminosity(float* c, float l)
     {
-        std::ostringstream os;
-        be<int16_t> adjusted_num_layers;
-        adjusted_num_layers = num_layers;
-        if (has_merged_alpha_channel)
-            adjusted_num_layers = -(int16_t)num_layers;
-#ifdef PSD_DEBUG
-        std::cout << "Writing number of layers: " << num_layers <<' ' << adjusted_num_layers << std::endl;
-#endif
-        os.write((char*)&adjusted_num_layers, 2);
-        for(auto& l:layers)
-        {
-            if (!l.write(os))
-                return false;
-        }
-        for(auto& l:layers)
+        float d = l - luminosity(c[0], c[1], c[2]);
+        for(int i = 0; i < 3; i ++)
+            c[i] += d;
+        l = luminosity(c[0], c[1], c[2]);
+        float n = std::min(c[0], std::min(c[1], c[2]));
+        float x = std::max(c[0], std::max(c[1], c[2]));
+        for(int i = 0; i < 3; i ++)
         {
-            if (!l.write_images(os))
-                return false;
+            if (n < 0)
+                c[i] = l + (c[i] - l)*l/(l - n);
+            if (x > 1)
+                c[i] = l + (c[i] - l)*(1 - l)/(x - l);
         }
+    }
 
-        std::string output = os.str();
-        if (output.size() % 2 == 1)
-            output += '\x00';
-
-        be<uint32_t> length = output.size();
-        f.write((char*)&length, 4);
-        f.write(output.data(), output.size());
-        
-        return true;
+    static inline float saturation(const float* c)
+    {
+        return std::max(c[0], std::max(c[1], c[2])) - std::min(c[0], std::min(c[1], c[2]));
     }
 
-    bool GlobalLayerMaskInfo::read(std::istream& f)
+    static void set_saturation(float* c, float s)
     {
-        f.read((char*)&length, 4);
-        if (length >= 2+2*4+2+1)
+        int lo = 0, hi = 0;
+        for(int i = 1; i < 3; i ++)
         {
-            f.read((char*)&overlay_colorspace, 2+2*4+2+1);
-            uint32_t remaining = length - (2+2*4+2+1);
-            data.resize(remaining);
-            f.read(&data[0], remaining);
+            if (c[i] < c[lo])
+                lo = i;
+            if (c[i] >= c[hi])
+                hi = i;
         }
-        else if (length != 0)
+        if (lo == hi)
+            hi = (lo + 1)%3;
+        int mid = 3 - lo - hi;
+        if (c[hi] > c[lo])
         {
-#ifdef PSD_DEBUG
-            std::cout << "Invalid GlobalLayerMaskInfo size: " << length << std::endl;
-#endif
-            return false;
+            c[mid] = (c[mid] - c[lo])*s/(c[hi] - c[lo]);
+            c[hi] = s;
         }
-        return true;
-    }
-
-    bool GlobalLayerMaskInfo::write(std::ostream& f)
-    {
-        f.write((char*)&length, 4);
-        if (length)
+        else
         {
-            f.write((char*)&overlay_colorspace, 2+2*4+2+1);
-            f.write((char*)&data[0], data.size());
+            c[mid] = c[hi] = 0;
         }
-        return true;
+        c[lo] = 0;
     }
 
-    bool ImageData::read_with_method(std::istream& f, uint32_t w, uint32_t h, uint16_t compression_method)
+    // Writes B(cb, cs) of blend mode blend for every channel to mixed,
+    // pointing it into scratch (3*n floats) or at the source colors.
+    static void blend_colors(uint32_t blend, const TilePixels& backdrop, const TilePixels& src, float* scratch, const float** mixed)
     {
-        this->w = w;
-        this->h = h;
-        this->compression_method = compression_method;
-        switch(compression_method)
+        size_t n = backdrop.pixels;
+        for(int c = 0; c < 3; c ++)
+            mixed[c] = scratch + c*n;
+        switch(blend)
         {
-            case 0: // RAW
+            case fourcc("hue "):
+            case fourcc("sat "):
+            case fourcc("colr"):
+            case fourcc("lum "):
+            case fourcc("dkCl"):
+            case fourcc("lgCl"):
+                for(size_t i = 0; i < n; i ++)
                 {
-                    data.resize(h);
-                    for(uint32_t y = 0; y < h; y ++)
+                    float b[3], s[3];
+                    for(int c = 0; c < 3; c ++)
                     {
-                        data[y].resize(w);
-                        f.read(&data[y][0], w);
+                        b[c] = backdrop.channel(c)[i];
+                        s[c] = src.channel(c)[i];
                     }
-                }
-                break;
-            case 1: // PackBits by line
-                {
-                    std::vector<be<uint16_t>> lengths;
-                    lengths.resize(h);
-                    f.read((char*)&lengths[0], 2*h);
-                    data.resize(h);
-                    for(uint32_t y = 0; y < h; y++)
+                    float lb = luminosity(b[0], b[1], b[2]);
+                    float ls = luminosity(s[0], s[1], s[2]);
+                    float* r = s;
+                    switch(blend)
                     {
-                        data[y].resize(lengths[y]);
-                        f.read(&data[y][0], lengths[y]);
-                        std::vector<char> uncompressed;
-
-                        for(uint32_t i = 0; i < data[y].size(); i ++)
-                        {
-                            int c = data[y][i];
-                            if (c >= 128) c -= 256;
-                            if (c == -128)
-                            {
-                                continue;
-                            }
-                            else if (c < 0)
-                            {
-                                i++;
-                                for(int j = 0; j < 1-c; j++)
-                                    uncompressed.push_back(data[y][i]);
-                            }
-                            else
-                            {
-                                if (i+1 + c+1 > data[y].size())
-                                {
-#ifdef PSD_DEBUG
-                                    std::cout << "PackBit source length invalid" << std::endl;
-#endif
-                                    return false;
-                                }
-                                uncompressed.insert(uncompressed.end(), data[y].begin()+i+1, data[y].begin()+i+1+c+1);
-                                i += c+1;
-                            }
-                        }
-                        if (uncompressed.size()*8%w != 0 || uncompressed.size() == 0)
-                        {
-#ifdef PSD_DEBUG
-                            std::cout << "PackBit line " << y << " uncompressed length invalid " << uncompressed.size() << ' ' << w << std::endl;
-#endif
-                            return false;
-                        }
-                        data[y].swap(uncompressed);
+                        case fourcc("hue "):
+                            set_saturation(s, saturation(b));
+                            set_luminosity(s, lb);
+                            break;
+                        case fourcc("sat "):
+                            set_saturation(b, saturation(s));
+                            set_luminosity(b, lb);
+                            r = b;
+                            break;
+                        case fourcc("colr"):
+                            set_luminosity(s, lb);
+                            break;
+                        case fourcc("lum "):
+                            set_luminosity(b, ls);
+                            r = b;
+                            break;
+                        case fourcc("dkCl"):
+                            r = ls < lb ? s : b;
+                            break;
+                        default: // lighter color
+                            r = ls > lb ? s : b;
                     }
+                    for(int c = 0; c < 3; c ++)
+                        scratch[c*n + i] = r[c];
                 }
-                break;
-            default:
-                if (compression_method >= 2)
-                {
-#ifdef PSD_DEBUG
-                    std::cout << "Not supported compression method (ImageData): " << compression_method << std::endl;
-#endif
-                    return false;
-                }
+                return;
+        }
+        for(int c = 0; c < 3; c ++)
+        {
+            const float* cb = backdrop.channel(c);
+            const float* cs = src.channel(c);
+            float* out = scratch + c*n;
+            switch(blend)
+            {
+                case fourcc("mul "): blend_channel(cb, cs, out, n, [](float b, float s) { return b*s; }); break;
+                case fourcc("scrn"): blend_channel(cb, cs, out, n, [](float b, float s) { return screen(b, s); }); break;
+                case fourcc("over"): blend_channel(cb, cs, out, n, [](float b, float s) { return hard_light(s, b); }); break;
+                case fourcc("dark"): blend_channel(cb, cs, out, n, [](float b, float s) { return std::min(b, s); }); break;
+                case fourcc("lite"): blend_channel(cb, cs, out, n, [](float b, float s) { return std::max(b, s); }); break;
+                case fourcc("diff"): blend_channel(cb, cs, out, n, [](float b, float s) { return std::abs(b - s); }); break;
+                case fourcc("smud"): blend_channel(cb, cs, out, n, [](float b, float s) { return b + s - 2*b*s; }); break;
+                case fourcc("div "): blend_channel(cb, cs, out, n, [](float b, float s) { return color_dodge(b, s); }); break;
+                case fourcc("idiv"): blend_channel(cb, cs, out, n, [](float b, float s) { return color_burn(b, s); }); break;
+                case fourcc("lddg"): blend_channel(cb, cs, out, n, [](float b, float s) { return std::min(1.0f, b + s); }); break;
+                case fourcc("lbrn"): blend_channel(cb, cs, out, n, [](float b, float s) { return std::max(0.0f, b + s - 1); }); break;
+                case fourcc("hLit"): blend_channel(cb, cs, out, n, [](float b, float s) { return hard_light(b, s); }); break;
+                case fourcc("sLit"): blend_channel(cb, cs, out, n, [](float b, float s) { return soft_light(b, s); }); break;
+                case fourcc("vLit"): blend_channel(cb, cs, out, n, [](float b, float s) { return vivid_light(b, s); }); break;
+                case fourcc("lLit"): blend_channel(cb, cs, out, n, [](float b, float s) { return clamp01(b + 2*s - 1); }); break;
+                case fourcc("pLit"): blend_channel(cb, cs, out, n, [](float b, float s) { return s <= 0.5f ? std::min(b, 2*s) : std::max(b, 2*s - 1); }); break;
+                case fourcc("hMix"): blend_channel(cb, cs, out, n, [](float b, float s) { return vivid_light(b, s) < 0.5f ? 0.0f : 1.0f; }); break;
+                case fourcc("fsub"): blend_channel(cb, cs, out, n, [](float b, float s) { return std::max(0.0f, b - s); }); break;
+                case fourcc("fdiv"): blend_channel(cb, cs, out, n, [](float b, float s) { return s <= 0 ? (b <= 0 ? 0.0f : 1.0f) : std::min(1.0f, b/s); }); break;
+                default: // normal, dissolve and anything unknown
+                    mixed[c] = cs;
+            }
         }
-
-        return true;
-    }
-
-    bool ImageData::read(std::istream& f, uint32_t w, uint32_t h)
-    {
-        this->w = w;
-        this->h = h;
-        f.read((char*)&compression_method, 2);
-        return read_with_method(f, w, h, compression_method);
     }
 
-    size_t PackBitCompress(const std::vector<char>& input, std::vector<char>& output)
+    // Source over compositing of one channel with the blended colors mixed:
+    // cb = (as (1-ab) cs + as ab B + (1-as) ab cb) / ao. With preserve_alpha
+    // (clipping) the backdrop keeps its alpha: cb += as (B - cb).
+    static void composite_channel(float* cb, const float* mixed, const float* cs, const float* as, const float* ab, size_t n, bool preserve_alpha)
     {
-        auto it = input.begin();
-        auto output_size_at_start = output.size();
-        std::vector<char> sequence;
-        while(it < input.end())
+        size_t i = 0;
+#ifdef PSD_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        const __m128 one = _mm_set1_ps(1.0f);
+        for(; i + 4 <= n; i += 4)
         {
-            if (std::distance(it, input.end()) >= 3 && *it == *(it+1) && *it == *(it+2))
-            {
-                if (!sequence.empty())
-                {
-                    output.push_back((char)sequence.size()-1);
-                    output.insert(output.end(), sequence.begin(), sequence.end());
-                    sequence.clear();
-                }
-                int count = 0;
-                char c = *it;
-                while(it < input.end() && *it == c) ++it, ++count;
-                while(count > 128)
-                {
-                    count -= 128;
-                    output.push_back((char)-127);
-                    output.push_back(c);
-                }
-                output.push_back((char)(1-count));
-                output.push_back(c);
-            }
-            else
+            __m128 b = _mm_loadu_ps(cb + i);
+            __m128 m = _mm_loadu_ps(mixed + i);
+            __m128 sa = _mm_loadu_ps(as + i);
+            if (preserve_alpha)
             {
-                sequence.push_back(*it);
-                if (sequence.size() == 128)
-                {
-                    output.push_back(127);
-                    output.insert(output.end(), sequence.begin(), sequence.end());
-                    sequence.clear();
-                }
-                ++it;
+                _mm_storeu_ps(cb + i, _mm_add_ps(b, _mm_mul_ps(sa, _mm_sub_ps(m, b))));
+                continue;
             }
+            __m128 s = _mm_loadu_ps(cs + i);
+            __m128 ba = _mm_loadu_ps(ab + i);
+            __m128 sa_ba = _mm_mul_ps(sa, ba);
+            __m128 ao = _mm_sub_ps(_mm_add_ps(sa, ba), sa_ba);
+            __m128 num = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_sub_ps(sa, sa_ba), s), _mm_mul_ps(sa_ba, m)),
+                _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(one, sa), ba), b));
+            __m128 nonzero = _mm_cmpgt_ps(ao, _mm_castsi128_ps(zero));
+            _mm_storeu_ps(cb + i, _mm_and_ps(nonzero, _mm_div_ps(num, _mm_or_ps(ao, _mm_andnot_ps(nonzero, one)))));
         }
-        if (!sequence.empty())
+#endif
+        for(; i < n; i ++)
         {
-            output.push_back((char)sequence.size()-1);
-            output.insert(output.end(), sequence.begin(), sequence.end());
-            sequence.clear();
+            if (preserve_alpha)
+            {
+                cb[i] += as[i]*(mixed[i] - cb[i]);
+                continue;
+            }
+            float ao = as[i] + ab[i] - as[i]*ab[i];
+            float num = (as[i] - as[i]*ab[i])*cs[i] + as[i]*ab[i]*mixed[i] + (1 - as[i])*ab[i]*cb[i];
+            cb[i] = ao > 0 ? num/ao : 0;
         }
-#ifdef PSD_DEBUG
+    }
+
+    // Composites src, its alpha scaled by opacity, onto dst with blend mode
+    // blend; with preserve_alpha dst keeps its alpha (clipping). scratch is
+    // reused between calls.
+    static void blend_pixels(const TilePixels& src, float opacity, uint32_t blend, TilePixels& dst, bool preserve_alpha, std::vector<float>& scratch)
+    {
+        size_t n = dst.pixels;
+        scratch.resize(4*n);
+        float* as = scratch.data() + 3*n;
+        const float* sa = src.channel(3);
+        for(size_t i = 0; i < n; i ++)
+            as[i] = sa[i]*opacity;
+        const float* mixed[3];
+        blend_colors(blend, dst, src, scratch.data(), mixed);
+        float* ab = dst.channel(3);
+        for(int c = 0; c < 3; c ++)
+            composite_channel(dst.channel(c), mixed[c], src.channel(c), as, ab, n, preserve_alpha);
+        if (!preserve_alpha)
+            for(size_t i = 0; i < n; i ++)
+                ab[i] = as[i] + ab[i] - as[i]*ab[i];
+    }
+
+    // Composites layers [begin, end) onto backdrop for one tile.
+    static void composite_range(const std::vector<CompositeLayer>& layers, size_t begin, size_t end, const Tile& tile, TilePixels& backdrop, TileScratch& scratch)
+    {
+        size_t i = begin;
+        while(i < end)
         {
-            std::vector<char> uncompressed;
-            for(uint32_t i = output_size_at_start; i < output.size(); i ++)
+            const CompositeLayer& layer = layers[i];
+            if (layer.type == 3)
             {
-                int c = output[i];
-                if (c >= 128) c -= 256;
-                if (c == -128)
+                // a group; its properties are on the record closing it.
+                // Layers clipped to it clip to its composited result, as in
+                // Photoshop, so a pass through group with clipped layers is
+                // isolated.
+                const CompositeLayer& group = layers[layer.group_end];
+                size_t first_clipped = layer.group_end + 1;
+                size_t next = first_clipped;
+                while(next < end && layers[next].clipped && layers[next].type == 0)
+                    next ++;
+                if (!group.visible)
                 {
+                    i = next;
                     continue;
                 }
-                else if (c < 0)
+                if (group.blend == fourcc("pass") && first_clipped == next)
                 {
-                    i++;
-                    for(int j = 0; j < 1-c; j++)
-                        uncompressed.push_back(output[i]);
+                    // children blend straight onto the backdrop; opacity
+                    // and mask fade between before and after
+                    bool fade = group.opacity < 1 || group.mask;
+                    ScratchPixels before(scratch);
+                    if (fade)
+                        before->values = backdrop.values;
+                    composite_range(layers, i + 1, layer.group_end, tile, backdrop, scratch);
+                    if (fade)
+                    {
+                        std::vector<float> amount(tile.pixels(), group.opacity);
+                        if (group.mask)
+                            apply_layer_mask(group, tile, amount.data());
+                        for(int c = 0; c < 4; c ++)
+                        {
+                            float* after = backdrop.channel(c);
+                            const float* b = before->channel(c);
+                            for(size_t p = 0; p < tile.pixels(); p ++)
+                                after[p] = b[p] + amount[p]*(after[p] - b[p]);
+                        }
+                    }
                 }
                 else
                 {
-                    if (i+1 + c+1 > output.size())
+                    ScratchPixels isolated(scratch);
+                    isolated->clear();
+                    composite_range(layers, i + 1, layer.group_end, tile, *isolated, scratch);
+                    if (group.mask)
+                        apply_layer_mask(group, tile, isolated->channel(3));
+                    ScratchPixels clip(scratch);
+                    for(size_t k = first_clipped; k < next; k ++)
                     {
-#ifdef PSD_DEBUG
-                        std::cout << "PackBit source length invalid" << std::endl;
-#endif
-                        assert(false);
+                        if (layers[k].visible && fetch_layer(layers[k], tile, *clip))
+                            blend_pixels(*clip, layers[k].opacity, layers[k].blend, *isolated, true, scratch.blend);
                     }
-                    uncompressed.insert(uncompressed.end(), output.begin()+i+1, output.begin()+i+1+c+1);
-                    i += c+1;
+                    blend_pixels(*isolated, group.opacity, group.blend, backdrop, false, scratch.blend);
                 }
+                i = next;
+                continue;
             }
-            if (input.size() != uncompressed.size())
-            {
-                for(uint32_t i = 0; i < input.size(); i ++)
-                    std::cout << (int)input[i] << ' ';
-                std::cout << std::endl;
-                for(uint32_t i = output_size_at_start; i < output.size(); i ++)
-                    std::cout << (int)output[i] << ' ';
-                std::cout << std::endl;
-                for(uint32_t i = 0; i < uncompressed.size(); i ++)
-                    std::cout << (int)uncompressed[i] << ' ';
-                std::cout << std::endl;
 
-            }
-            assert(input.size() == uncompressed.size());
-            for(uint32_t i = 0; i < uncompressed.size(); i ++)
+            // a pixel layer and the layers clipped to it
+            size_t next = i + 1;
+            while(next < end && layers[next].clipped && layers[next].type == 0)
+                next ++;
+            ScratchPixels base(scratch);
+            if (layer.type == 0 && layer.visible && fetch_layer(layer, tile, *base))
             {
-                assert(input[i] == uncompressed[i]);
+                ScratchPixels clip(scratch);
+                for(size_t k = i + 1; k < next; k ++)
+                {
+                    if (layers[k].visible && fetch_layer(layers[k], tile, *clip))
+                        blend_pixels(*clip, layers[k].opacity, layers[k].blend, *base, true, scratch.blend);
+                }
+                blend_pixels(*base, layer.opacity, layer.blend, backdrop, false, scratch.blend);
             }
+            i = next;
         }
-#endif
-        return output.size() - output_size_at_start;
     }
 
-    bool ImageData::write(std::ostream& f)
+    // Converts pixels [at, at + n) of a tile to interleaved 8 bit RGBA.
+    static void pixels_to_rgba8(const TilePixels& pixels, size_t at, size_t n, uint8_t* out)
     {
-        uint64_t raw_size = w*h;
-        std::vector<be<uint16_t>> sizes;
-        std::vector<char> merged;
-        uint64_t packed_size = 0;
-
-        for(auto& line:data)
+        const float* r = pixels.channel(0) + at;
+        const float* g = pixels.channel(1) + at;
+        const float* b = pixels.channel(2) + at;
+        const float* a = pixels.channel(3) + at;
+        size_t x = 0;
+#ifdef PSD_SSE2
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 scale = _mm_set1_ps(255.0f);
+        const __m128 half = _mm_set1_ps(0.5f);
+        auto to_int = [&](const float* p) {
+            __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(p), zero), one);
+            return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, scale), half));
+        };
+        for(; x + 4 <= n; x += 4)
         {
-            sizes.push_back(PackBitCompress(line, merged));
-            packed_size += (uint16_t)sizes.back();
+            // four pixels as little endian 32 bit words
+            __m128i v = _mm_or_si128(_mm_or_si128(to_int(r + x), _mm_slli_epi32(to_int(g + x), 8)),
+                _mm_or_si128(_mm_slli_epi32(to_int(b + x), 16), _mm_slli_epi32(to_int(a + x), 24)));
+            _mm_storeu_si128((__m128i*)(out + 4*x), v);
         }
-        
-        if (raw_size > packed_size + 2 * sizes.size())
+#endif
+        for(; x < n; x ++)
         {
-            // using PackBits
-            compression_method = 1;
-            f.write((char*)&compression_method, 2);
-            f.write((char*)&sizes[0], sizes.size() * 2);
-            f.write(merged.data(), merged.size());
+            out[4*x] = (uint8_t)(clamp01(r[x])*255 + 0.5f);
+            out[4*x + 1] = (uint8_t)(clamp01(g[x])*255 + 0.5f);
+            out[4*x + 2] = (uint8_t)(clamp01(b[x])*255 + 0.5f);
+            out[4*x + 3] = (uint8_t)(clamp01(a[x])*255 + 0.5f);
         }
+    }
+
+    // Fills out for every layer; only the channels of layers [first, last)
+    // are decoded and only those may be composited.
+    static bool prepare_composite(std::vector<Layer>& layers, size_t first, size_t last, uint16_t bit_depth, bool use_masks, ThreadPool* pool, std::vector<CompositeLayer>& out)
+    {
+        // decode every channel up front; ImageData::decode is not safe to
+        // run twice on one channel concurrently
+        std::vector<ImageData*> channels;
+        for(size_t i = first; i < last; i ++)
+            for(auto& id:layers[i].channel_info_data)
+                channels.push_back(&id);
+        std::atomic<bool> ok(true);
+        auto decode = [&](size_t i) {
+            if (!channels[i]->decode())
+                ok = false;
+        };
+        if (pool)
+            pool->parallel_for(channels.size(), decode);
         else
+            for(size_t i = 0; i < channels.size(); i ++)
+                decode(i);
+        if (!ok)
+            return false;
+
+        LayerTree tree;
+        tree.build(layers);
+        out.resize(layers.size());
+        for(size_t i = 0; i < layers.size(); i ++)
         {
-            // using raw
-            compression_method = 0;
-            f.write((char*)&compression_method, 2);
-            for(auto& line:data)
+            Layer& layer = layers[i];
+            CompositeLayer& cl = out[i];
+            cl.blend = layer.blend_key;
+            // an unmatched divider or group record has no pixels
+            bool unmatched = section_type(layer, cl.blend) != tree.nodes[i].type;
+            cl.type = tree.nodes[i].type;
+            cl.group_end = cl.type == 3 ? tree.nodes[i].parent : 0;
+            cl.visible = !(layer.bit_flags & 2);
+            cl.clipped = layer.clipping != 0;
+            const ExtraData* fill = find_extra_data(layer, "iOpa");
+            cl.opacity = layer.opacity/255.0f*(fill && !fill->data.empty() ? (uint8_t)fill->data[0]/255.0f : 1.0f);
+            cl.left = layer.left;
+            cl.top = layer.top;
+            cl.right = layer.right;
+            cl.bottom = layer.bottom;
+            cl.bit_depth = bit_depth;
+            if (i < first || i >= last || unmatched)
+            {
+                cl.color[0] = cl.color[1] = cl.color[2] = cl.alpha = cl.mask = nullptr;
+                continue;
+            }
+            ImageData* color[3] = {layer.get_channel_info_by_id(0), layer.get_channel_info_by_id(1), layer.get_channel_info_by_id(2)};
+            ImageData* alpha = layer.get_channel_info_by_id(-1);
+            ImageData* mask = use_masks && layer.mask.length && !(layer.mask.flags & 2) ? layer.get_channel_info_by_id(-2) : nullptr;
+            bool gray = !color[1] || !color[2];
+            for(int c = 0; c < 3; c ++)
+                cl.color[c] = color[c] && (c == 0 || !gray) ? color[c] : nullptr;
+            cl.alpha = alpha;
+            cl.mask = mask;
+            cl.mask_left = layer.mask.left;
+            cl.mask_top = layer.mask.top;
+            cl.mask_width = mask ? mask->w : 0;
+            cl.mask_height = mask ? mask->h : 0;
+            cl.mask_default = layer.mask.default_color/255.0f;
+            for(auto* id:{color[0], color[1], color[2], alpha})
             {
-                f.write(line.data(), line.size());
+                if (id && (id->w != (uint32_t)(cl.right - cl.left) || id->h != (uint32_t)(cl.bottom - cl.top) || id->bit_depth != bit_depth))
+                {
+                    PSD_TRACE(Error, Layer, "Layer " << i << " channels do not match its bounds");
+                    return false;
+                }
             }
         }
+        return true;
+    }
+
+    static bool can_composite(const Header& header)
+    {
+        if (header.color_mode != (uint16_t)ColorMode::RGB && header.color_mode != (uint16_t)ColorMode::Grayscale)
+        {
+            PSD_TRACE(Error, Layer, "Cannot composite color mode " << header.color_mode);
+            return false;
+        }
+        return true;
+    }
 
+    // Composites layers [first, last) in the tiles of the width x height
+    // rectangle at (left, top), numbered row by row, to dst; all of them,
+    // or those in only.
+    static void composite_tiles(const std::vector<CompositeLayer>& layers, size_t first, size_t last, uint32_t left, uint32_t top, uint32_t width, uint32_t height, uint32_t tile_size,
+        const std::vector<size_t>* only, char* dst, size_t stride, ThreadPool* pool)
+    {
+        uint32_t tiles_x = (width + tile_size - 1)/tile_size;
+        uint32_t tiles_y = (height + tile_size - 1)/tile_size;
+        auto composite_tile = [&](size_t i) {
+            size_t index = only ? (*only)[i] : i;
+            Tile tile;
+            uint32_t tx = index%tiles_x*tile_size;
+            uint32_t ty = index/tiles_x*tile_size;
+            tile.left = left + tx;
+            tile.top = top + ty;
+            tile.width = std::min(tile_size, width - tx);
+            tile.height = std::min(tile_size, height - ty);
+            TilePixels pixels(tile.pixels());
+            TileScratch scratch(tile.pixels());
+            composite_range(layers, first, last, tile, pixels, scratch);
+            for(uint32_t y = 0; y < tile.height; y ++)
+                pixels_to_rgba8(pixels, (size_t)y*tile.width, tile.width, (uint8_t*)dst + (ty + y)*stride + (size_t)tx*4);
+        };
+        size_t tiles = only ? only->size() : (size_t)tiles_x*tiles_y;
+        if (pool)
+            pool->parallel_for(tiles, composite_tile);
+        else
+            for(size_t i = 0; i < tiles; i ++)
+                composite_tile(i);
+    }
+
+    bool psd::composite(char* dst, size_t stride, const CompositeOptions& options)
+    {
+        return composite(0, 0, header.width, header.height, dst, stride, options);
+    }
+
+    bool psd::composite(uint32_t left, uint32_t top, uint32_t width, uint32_t height, char* dst, size_t stride, const CompositeOptions& options)
+    {
+        if (!can_composite(header))
+            return false;
+        std::unique_ptr<ThreadPool> pool;
+        if (options.threads != 1)
+            pool.reset(new ThreadPool(options.threads));
+        std::vector<CompositeLayer> layers;
+        if (!prepare_composite(layer_info.layers, 0, layer_info.layers.size(), header.bit_depth, options.use_masks, pool.get(), layers))
+            return false;
+        composite_tiles(layers, 0, layers.size(), left, top, width, height, std::max<uint32_t>(options.tile_size, 1), nullptr, dst, stride, pool.get());
         return true;
     }
 
-    bool MultipleImageData::read(std::istream& f, uint32_t w, uint32_t h, uint32_t count, uint16_t bit_depth)
+    bool psd::composite_subtree(size_t index, uint32_t left, uint32_t top, uint32_t width, uint32_t height, char* dst, size_t stride, const CompositeOptions& options)
     {
-        this->w = w;
-        this->h = h;
-        this->count = count;
-        f.read((char*)&compression_method, 2);
-        ImageData imageData;
-        if (!imageData.read_with_method(f, w, h*count, compression_method))
+        if (!can_composite(header))
+            return false;
+        if (index >= layer_info.layers.size())
         {
-            std::cerr << "MultipleImageData::read error" << std::endl;
+            PSD_TRACE(Error, Layer, "No layer " << index);
             return false;
         }
-        datas.resize(count);
-        uint32_t row = 0;
-        for(uint32_t ch = 0; ch < count; ch ++)
+        LayerTree tree;
+        tree.build(layer_info.layers);
+        size_t first = tree.nodes[index].first;
+        if (tree.nodes[index].type == 3)
         {
-            datas[ch].resize(h);
-            for(uint32_t y = 0; y < h; y ++)
+            // a divider stands for its group
+            index = tree.nodes[index].parent;
+            first = tree.nodes[index].first;
+        }
+        std::unique_ptr<ThreadPool> pool;
+        if (options.threads != 1)
+            pool.reset(new ThreadPool(options.threads));
+        std::vector<CompositeLayer> layers;
+        if (!prepare_composite(layer_info.layers, first, index + 1, header.bit_depth, options.use_masks, pool.get(), layers))
+            return false;
+        layers[index].visible = true;
+        composite_tiles(layers, first, index + 1, left, top, width, height, std::max<uint32_t>(options.tile_size, 1), nullptr, dst, stride, pool.get());
+        return true;
+    }
+
+    // What each layer can change: its bounds and its mask rectangle; for a
+    // group (both of its records), everything inside.
+    static void layer_extents(const std::vector<Layer>& layers, std::vector<Compositor::Rect>& out)
+    {
+        auto unite = [](Compositor::Rect& r, const Compositor::Rect& y) {
+            if (y.left >= y.right || y.top >= y.bottom)
+                return;
+            if (r.left >= r.right || r.top >= r.bottom)
             {
-                datas[ch][y].swap(imageData.data[row++]);
-                if (datas[ch][y].size() != w*bit_depth/8)
-                {
-#ifdef PSD_DEBUG
-                    std::cout << datas[ch][y].size() << ' ' << w << ' ' <<bit_depth << std::endl;
-#endif
-                    return false;
-                }
+                r = y;
+                return;
+            }
+            r.left = std::min(r.left, y.left);
+            r.top = std::min(r.top, y.top);
+            r.right = std::max(r.right, y.right);
+            r.bottom = std::max(r.bottom, y.bottom);
+        };
+        out.assign(layers.size(), Compositor::Rect());
+        LayerTree tree;
+        tree.build(layers);
+        for(size_t i = 0; i < layers.size(); i ++)
+        {
+            const Layer& layer = layers[i];
+            const LayerTree::Node& node = tree.nodes[i];
+            // a divider collects the group contents, its record copies them
+            if (node.type == 3)
+                continue;
+            Compositor::Rect& r = out[i];
+            if (tree.is_group(i))
+            {
+                r = out[node.first];
+            }
+            else
+            {
+                r.left = layer.left;
+                r.top = layer.top;
+                r.right = layer.right;
+                r.bottom = layer.bottom;
+                if (layer.mask.length)
+                    unite(r, Compositor::Rect{(int32_t)layer.mask.left, (int32_t)layer.mask.top, (int32_t)layer.mask.right, (int32_t)layer.mask.bottom});
             }
+            if (node.parent >= 0)
+                unite(out[tree.nodes[node.parent].first], r);
         }
-        return true;
     }
 
-    bool MultipleImageData::write(std::ostream& f)
+    bool psd::composite_subtree(size_t index, Plane& out, uint32_t& left, uint32_t& top, const CompositeOptions& options)
     {
-        ImageData imageData;
-        imageData.w = w;
-        imageData.h = h * datas.size();
-        for(auto& data:datas)
+        if (index >= layer_info.layers.size())
         {
-            for(auto& line:data)
-                imageData.data.push_back(line);
+            PSD_TRACE(Error, Layer, "No layer " << index);
+            return false;
         }
-        if (!imageData.write(f))
+        std::vector<Compositor::Rect> extents;
+        layer_extents(layer_info.layers, extents);
+        // within the document
+        const Compositor::Rect& r = extents[index];
+        int64_t x0 = std::max<int64_t>(r.left, 0);
+        int64_t y0 = std::max<int64_t>(r.top, 0);
+        int64_t x1 = std::min<int64_t>(r.right, header.width);
+        int64_t y1 = std::min<int64_t>(r.bottom, header.height);
+        if (x0 >= x1 || y0 >= y1)
+            x0 = x1 = y0 = y1 = 0;
+        left = (uint32_t)x0;
+        top = (uint32_t)y0;
+        out.allocate((size_t)(x1 - x0)*4, (uint32_t)(y1 - y0));
+        return composite_subtree(index, left, top, (uint32_t)(x1 - x0), (uint32_t)(y1 - y0), out.data(), out.stride(), options);
+    }
+
+    Compositor::Compositor(psd& document, const CompositeOptions& options)
+        : document_(document), options_(options), tiles_x_(0), valid_(false)
+    {
+        options_.tile_size = std::max<uint32_t>(options_.tile_size, 1);
+        if (options_.threads != 1)
+            pool_.reset(new ThreadPool(options_.threads));
+    }
+
+    Compositor::~Compositor()
+    {
+    }
+
+    void Compositor::invalidate(int32_t left, int32_t top, uint32_t width, uint32_t height)
+    {
+        if (!valid_)
+            return;
+        int64_t w = pixels_.row_bytes()/4;
+        int64_t h = pixels_.height();
+        int64_t x0 = std::max<int64_t>(left, 0);
+        int64_t y0 = std::max<int64_t>(top, 0);
+        int64_t x1 = std::min<int64_t>((int64_t)left + width, w);
+        int64_t y1 = std::min<int64_t>((int64_t)top + height, h);
+        if (x0 >= x1 || y0 >= y1)
+            return;
+        uint32_t t = options_.tile_size;
+        for(int64_t ty = y0/t; ty <= (y1 - 1)/t; ty ++)
+            for(int64_t tx = x0/t; tx <= (x1 - 1)/t; tx ++)
+                dirty_[ty*tiles_x_ + tx] = 1;
+    }
+
+    void Compositor::invalidate(const Rect& r)
+    {
+        if (r.left < r.right && r.top < r.bottom)
+            invalidate(r.left, r.top, (uint32_t)((int64_t)r.right - r.left), (uint32_t)((int64_t)r.bottom - r.top));
+    }
+
+    void Compositor::invalidate_layer(size_t index)
+    {
+        if (!valid_)
+            return;
+        if (index < extents_.size())
+            invalidate(extents_[index]);
+        std::vector<Rect> current;
+        layer_extents(document_.layers(), current);
+        if (index < current.size())
+            invalidate(current[index]);
+    }
+
+    void Compositor::invalidate_all()
+    {
+        valid_ = false;
+    }
+
+    bool Compositor::update()
+    {
+        Header& header = document_.header;
+        if (!can_composite(header))
             return false;
+        std::vector<Layer>& layers = document_.layers();
+        uint32_t w = header.width;
+        uint32_t h = header.height;
+        if (!valid_ || pixels_.row_bytes() != (size_t)w*4 || pixels_.height() != h || extents_.size() != layers.size())
+        {
+            pixels_.allocate((size_t)w*4, h);
+            tiles_x_ = (w + options_.tile_size - 1)/options_.tile_size;
+            dirty_.assign((size_t)tiles_x_*((h + options_.tile_size - 1)/options_.tile_size), 1);
+        }
+        std::vector<size_t> tiles;
+        for(size_t i = 0; i < dirty_.size(); i ++)
+            if (dirty_[i])
+                tiles.push_back(i);
+        if (!tiles.empty())
+        {
+            std::vector<CompositeLayer> prepared;
+            if (!prepare_composite(layers, 0, layers.size(), header.bit_depth, options_.use_masks, pool_.get(), prepared))
+            {
+                valid_ = false;
+                return false;
+            }
+            composite_tiles(prepared, 0, prepared.size(), 0, 0, w, h, options_.tile_size, &tiles, pixels_.data(), pixels_.stride(), pool_.get());
+            std::fill(dirty_.begin(), dirty_.end(), 0);
+        }
+        layer_extents(layers, extents_);
+        valid_ = true;
         return true;
     }
 
-    bool psd::read_layers_and_masks(std::istream& f)
+    bool psd::read_layers_and_masks(ByteReader& f, const LoadOptions& options)
     {
-
-        be<uint32_t> length;
-        f.read((char*)&length, 4);
-        auto start_pos = f.tellg();
+        uint64_t length = f.read_length();
+        auto start_pos = f.tell();
         
         if (length == 0)
             return true;
 
-        if (!layer_info.read(f))
+        if (!layer_info.read(f, options, header.bit_depth))
             return false;
 
+        if (options.skip_images && !layer_info.layers.empty())
+        {
+            return f.seek(start_pos + length);
+        }
+
         if (!global_layer_mask_info.read(f))
             return false;
 
-        if (f.tellg()-start_pos < length)
+        // Tagged blocks. Documents over 8 bits keep their layers in Lr16 or
+        // Lr32 (some 8 bit ones in Layr) and leave the layer info above
+        // empty; those are read into layer_info, other blocks are kept as
+        // they are in additional_layer_data.
+        uint64_t end_pos = start_pos + length;
+        additional_layer_data.clear();
+        while(f.tell() + 12 <= end_pos)
         {
-            auto remaining = length - (f.tellg()-start_pos);
-#ifdef PSD_DEBUG
-            std::cout << "Layer remaining: " << remaining << " at " << f.tellg() << std::endl;
-#endif
-            additional_layer_data.resize(remaining);
-            f.read(&additional_layer_data[0], remaining);
+            auto block_pos = f.tell();
+            ExtraData block;
+            f.read((char*)&block.signature, 4);
+            f.read((char*)&block.key, 4);
+            if (block.signature != "8BIM" && block.signature != "8B64")
+            {
+                f.seek(block_pos);
+                break;
+            }
+            auto length_pos = f.tell();
+            uint64_t block_length = block.has_long_length(f.psb()) ? f.read_length() : f.read_be<uint32_t>();
+            auto data_pos = f.tell();
+            if (data_pos + block_length > end_pos)
+            {
+                PSD_TRACE(Error, Section, "Tagged block " << (std::string)block.key << " overruns the section");
+                return false;
+            }
+            if (layer_info.layers.empty() && (block.key == "Lr16" || block.key == "Lr32" || block.key == "Layr"))
+            {
+                PSD_TRACE(Debug, Section, "Layers in tagged block " << (std::string)block.key);
+                f.seek(length_pos);
+                if (!layer_info.read(f, options, header.bit_depth))
+                    return false;
+            }
+            else
+            {
+                f.seek(block_pos);
+                size_t size = additional_layer_data.size();
+                additional_layer_data.resize(size + (data_pos - block_pos) + block_length);
+                f.read(&additional_layer_data[size], additional_layer_data.size() - size);
+            }
+            f.seek(data_pos + block_length);
+        }
+        if (f.tell() < end_pos)
+        {
+            auto remaining = end_pos - f.tell();
+            PSD_TRACE(Debug, Section, "Layer remaining: " << remaining << " at " << f.tell());
+            size_t size = additional_layer_data.size();
+            additional_layer_data.resize(size + remaining);
+            f.read(&additional_layer_data[size], remaining);
         }
 
-        return true;
+        if (!options.subtree.empty() && layer_info.layers.empty())
+        {
+            PSD_TRACE(Error, Layer, "No layer or group " << options.subtree);
+            return false;
+        }
+        return (bool)f;
     }
 
-    bool psd::write_layers_and_masks(std::ostream& f)
+    bool psd::write_layers_and_masks(std::ostream& f, ThreadPool* pool, const SaveOptions& options)
     {
-        std::ostringstream os;
+        bool psb = header.version == 2;
+        // over 8 bits the layers go to a tagged block after the global
+        // layer mask, leaving the layer info empty
+        bool tagged = header.bit_depth > 8 && !layer_info.layers.empty();
+        auto write_layers_block_header = [&]() {
+            f.write("8BIM", 4);
+            f.write(layers_block_key(header.bit_depth), 4);
+        };
+        auto length_pos = f.tellp();
+        if (length_pos == std::streampos(-1))
+        {
+            uint64_t layer_info_size = layer_info.encode(pool, psb, options);
+            uint64_t empty_size = psb ? 8 : 4;
+            if (tagged)
+                write_length(f, empty_size + global_layer_mask_info.size() + 8 + layer_info_size + additional_layer_data.size(), psb);
+            else
+                write_length(f, layer_info_size + global_layer_mask_info.size() + additional_layer_data.size(), psb);
+            if (tagged)
+            {
+                write_length(f, 0, psb);
+                if (!global_layer_mask_info.write(f))
+                    return false;
+                write_layers_block_header();
+            }
+            if (!layer_info.write_encoded(f, layer_info_size, psb))
+                return false;
+        }
+        else
+        {
+            write_length(f, 0, psb);
+            if (tagged)
+            {
+                write_length(f, 0, psb);
+                if (!global_layer_mask_info.write(f))
+                    return false;
+                write_layers_block_header();
+            }
+            if (!layer_info.write(f, pool, psb, options))
+                return false;
+        }
 
-        if (!layer_info.write(os))
-            return false;
-        if (!global_layer_mask_info.write(os))
+        if (!tagged && !global_layer_mask_info.write(f))
             return false;
+        f.write(additional_layer_data.data(), additional_layer_data.size());
 
-        os.write(additional_layer_data.data(), additional_layer_data.size());
-
-        std::string output = os.str();
-        be<uint32_t> length(output.size());
-        f.write((char*)&length, 4);
-        f.write(output.data(), output.size());
+        if (length_pos != std::streampos(-1))
+        {
+            auto end_pos = f.tellp();
+            f.seekp(length_pos);
+            write_length(f, end_pos - length_pos - (psb ? 8 : 4), psb);
+            f.seekp(end_pos);
+        }
 
-        return true;
+        return (bool)f;
     }
 
-    bool psd::save(std::ostream& f)
+    bool psd::save(std::ostream& f, const SaveOptions& options)
     {
+        if (scanned_)
+        {
+            PSD_TRACE(Error, Section, "cannot save a scanned document");
+            return false;
+        }
+        if (header.version != 2 && (header.width > 30000 || header.height > 30000))
+        {
+            PSD_TRACE(Error, Header, "documents over 30000 pixels must be saved as PSB (header.version = 2)");
+            return false;
+        }
+        merged_image.set_psb(header.version == 2);
+        std::unique_ptr<ThreadPool> pool;
+        if (options.threads != 1)
+            pool.reset(new ThreadPool(options.threads));
         if (!write_header(f))
             return false;
         if (!write_color_mode(f))
             return false;
         if (!write_image_resources(f))
             return false;
-        if (!write_layers_and_masks(f))
+        if (!write_layers_and_masks(f, pool.get(), options))
             return false;
-        if (!merged_image.write(f))
+        if (!merged_image.write(f, pool.get()))
             return false;
 
         return true;
@@ -943,7 +4291,15 @@ namespace psd
 
     bool psd::write_header(std::ostream& f)
     {
-        f.write((char*)&header, sizeof(header));
+        f.write((char*)&header.signature, 4);
+        f.write((char*)&header.version, 2);
+        f.write((char*)&header.dummy1, 2);
+        f.write((char*)&header.dummy2, 4);
+        f.write((char*)&header.num_channels, 2);
+        f.write((char*)&header.height, 4);
+        f.write((char*)&header.width, 4);
+        f.write((char*)&header.bit_depth, 2);
+        f.write((char*)&header.color_mode, 2);
         return true;
     }
 
@@ -954,23 +4310,21 @@ namespace psd
         return true;
     }
 
-    bool psd::read_image_resources(std::istream& f)
+    bool psd::read_image_resources(ByteReader& f)
     {
         be<uint32_t> length;
         f.read((char*)&length, 4);
-#ifdef PSD_DEBUG
-        std::cout << "Image Resource Block length: " << length << std::endl;
-#endif
-        auto start_pos = f.tellg();
+        PSD_TRACE(Debug, ImageResource, "Image Resource Block length: " << length);
+        auto start_pos = f.tell();
 
         image_resources.clear();
 
-        while(f.tellg() - start_pos < length)
+        while(f.tell() - start_pos < length)
         {
             ImageResourceBlock b;
             if (!b.read(f))
             {
-                std::cerr << "Cannot read ImageResourceBlock" << std::endl;
+                PSD_TRACE(Error, ImageResource, "Cannot read ImageResourceBlock");
                 return false;
             }
             image_resources.push_back(std::move(b));
@@ -1,42 +1,136 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
+#include <functional>
 #include <string>
 #include <iostream>
 #include <vector>
 #include <unordered_map>
 #include <cassert>
+#include <cstring>
+#include <memory>
+#ifdef _MSC_VER
+#include <stdlib.h>
+#endif
 
 namespace psd
 {
+    enum class TraceLevel
+    {
+        Error = 0,
+        Info = 1,
+        Debug = 2,
+    };
+
+    enum class TraceEvent
+    {
+        Header,
+        ImageResource,
+        Section, // layer and mask information section
+        Layer,
+        ExtraData,
+        Channel,
+    };
+
+    typedef std::function<void(TraceLevel level, TraceEvent event, const std::string& message)> TraceSink;
+
+    // Routes diagnostics up to max_level to sink; by default errors are
+    // written to std::cerr and an empty sink silences everything. Debug
+    // additionally checks block sizes while reading and round trips every
+    // PackBits row written. Messages are only built for enabled levels.
+    // Not synchronized with loads and saves in flight; the sink may be
+    // called from ThreadPool workers.
+    void set_trace_sink(TraceSink sink, TraceLevel max_level = TraceLevel::Debug);
+    bool trace_enabled(TraceLevel level);
+
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define PSD_BIG_ENDIAN_HOST 1
+#else
+#define PSD_BIG_ENDIAN_HOST 0
+#endif
+
+    inline uint16_t byteswap(uint16_t x)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_bswap16(x);
+#elif defined(_MSC_VER)
+        return _byteswap_ushort(x);
+#else
+        return (uint16_t)((x << 8) | (x >> 8));
+#endif
+    }
+
+    inline uint32_t byteswap(uint32_t x)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_bswap32(x);
+#elif defined(_MSC_VER)
+        return _byteswap_ulong(x);
+#else
+        return (x << 24) | ((x << 8) & 0xff0000) | ((x >> 8) & 0xff00) | (x >> 24);
+#endif
+    }
+
+    inline uint64_t byteswap(uint64_t x)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_bswap64(x);
+#elif defined(_MSC_VER)
+        return _byteswap_uint64(x);
+#else
+        return ((uint64_t)byteswap((uint32_t)x) << 32) | byteswap((uint32_t)(x >> 32));
+#endif
+    }
+
+    // Converts between big endian and host order; a no-op on big endian hosts.
     template <typename T> void BEtoLE(T& x);
     template <> inline void BEtoLE<uint8_t>(uint8_t& x)
     {
         // do nothing;
     }
+    template <> inline void BEtoLE<int8_t>(int8_t& x)
+    {
+        // do nothing;
+    }
 
+#if PSD_BIG_ENDIAN_HOST
+    template <> inline void BEtoLE<uint16_t>(uint16_t& x) {}
+    template <> inline void BEtoLE<uint32_t>(uint32_t& x) {}
+    template <> inline void BEtoLE<uint64_t>(uint64_t& x) {}
+#else
+    template <> inline void BEtoLE<uint16_t>(uint16_t& x)
+    {
+        x = byteswap(x);
+    }
     template <> inline void BEtoLE<uint32_t>(uint32_t& x)
     {
-        uint8_t t;
-        uint8_t* p = reinterpret_cast<uint8_t*>(&x);
-        t = p[0]; p[0] = p[3]; p[3] = t;
-        t = p[1]; p[1] = p[2]; p[2] = t;
+        x = byteswap(x);
     }
-    template <> inline void BEtoLE<uint16_t>(uint16_t& x)
+    template <> inline void BEtoLE<uint64_t>(uint64_t& x)
     {
-        uint8_t t;
-        uint8_t* p = reinterpret_cast<uint8_t*>(&x);
-        t = p[0]; p[0] = p[1]; p[1] = t;
+        x = byteswap(x);
+    }
+#endif
+    template <> inline void BEtoLE<int16_t>(int16_t& x)
+    {
+        BEtoLE(*(uint16_t*)&x);
     }
     template <> inline void BEtoLE<int32_t>(int32_t& x)
     {
         BEtoLE(*(uint32_t*)&x);
     }
-    template <> inline void BEtoLE<int16_t>(int16_t& x)
+    template <> inline void BEtoLE<int64_t>(int64_t& x)
     {
-        BEtoLE(*(uint16_t*)&x);
+        BEtoLE(*(uint64_t*)&x);
     }
 
+    // Bulk conversion of count big endian values to host order in place
+    // (and back, the swap being its own inverse). data needs no alignment.
+    void BEtoLE(uint16_t* data, size_t count);
+    void BEtoLE(uint32_t* data, size_t count);
+    void BEtoLE(uint64_t* data, size_t count);
+
     template <typename T>
     struct be
     {
@@ -80,19 +174,15 @@ namespace psd
 
         T operator += (T y)
         {
-            BEtoLE(x);
-            x += y;
-            T xx = x;
-            BEtoLE(x);
+            T xx = (T)*this + y;
+            *this = xx;
             return xx;
         }
 
         T operator -= (T y)
         {
-            BEtoLE(x);
-            x -= y;
-            T xx = x;
-            BEtoLE(x);
+            T xx = (T)*this - y;
+            *this = xx;
             return xx;
         }
     };
@@ -144,6 +234,389 @@ namespace psd
     }
 
 
+    // Byte buffer that either owns its storage or refers to bytes owned by
+    // someone else (e.g. a memory mapped file). Any mutation detaches a view
+    // into an owned copy first.
+    class Buffer
+    {
+        public:
+            Buffer()
+                : view_(nullptr), view_size_(0)
+            {
+            }
+
+            Buffer(const Buffer&) = default;
+            Buffer& operator = (const Buffer&) = default;
+
+            Buffer(Buffer&& y)
+                : owned_(std::move(y.owned_)), view_(y.view_), view_size_(y.view_size_), owner_(std::move(y.owner_))
+            {
+                y.release();
+            }
+
+            Buffer& operator = (Buffer&& y)
+            {
+                owned_ = std::move(y.owned_);
+                view_ = y.view_;
+                view_size_ = y.view_size_;
+                owner_ = std::move(y.owner_);
+                y.release();
+                return *this;
+            }
+
+            size_t size() const { return view_ ? view_size_ : owned_.size(); }
+            bool empty() const { return size() == 0; }
+            bool is_view() const { return view_ != nullptr; }
+
+            const char* data() const { return view_ ? view_ : owned_.data(); }
+            const char* begin() const { return data(); }
+            const char* end() const { return data() + size(); }
+            const char& operator [] (size_t i) const { return data()[i]; }
+
+            char* mutable_data()
+            {
+                detach();
+                return owned_.data();
+            }
+
+            void resize(size_t n)
+            {
+                detach();
+                owned_.resize(n);
+            }
+
+            void push_back(char c)
+            {
+                detach();
+                owned_.push_back(c);
+            }
+
+            void clear()
+            {
+                release();
+                owned_.clear();
+            }
+
+            void assign(const char* p, size_t n)
+            {
+                release();
+                owned_.assign(p, p+n);
+            }
+
+            void assign(std::vector<char>&& v)
+            {
+                release();
+                owned_ = std::move(v);
+            }
+
+            void assign_view(const char* p, size_t n, std::shared_ptr<const void> owner)
+            {
+                owned_.clear();
+                view_ = p;
+                view_size_ = n;
+                owner_ = std::move(owner);
+            }
+
+        private:
+            void detach()
+            {
+                if (!view_)
+                    return;
+                owned_.assign(view_, view_+view_size_);
+                release();
+            }
+
+            void release()
+            {
+                view_ = nullptr;
+                view_size_ = 0;
+                owner_.reset();
+            }
+
+            std::vector<char> owned_;
+            const char* view_;
+            size_t view_size_;
+            std::shared_ptr<const void> owner_;
+    };
+
+    template <typename T>
+    struct Span
+    {
+        Span()
+            : ptr(nullptr), count(0)
+        {}
+        Span(T* ptr, size_t count)
+            : ptr(ptr), count(count)
+        {}
+
+        T* data() const { return ptr; }
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+        T* begin() const { return ptr; }
+        T* end() const { return ptr + count; }
+        T& operator [] (size_t i) const { return ptr[i]; }
+
+        T* ptr;
+        size_t count;
+    };
+
+    // Pixels of one channel in a single allocation. Rows are row_bytes long
+    // and start every stride bytes; the first row and the stride are
+    // aligned to Plane::alignment so rows can be handed to SIMD code as is.
+    class Plane
+    {
+        public:
+            static const size_t alignment = 64;
+
+            Plane()
+                : data_(nullptr), row_bytes_(0), stride_(0), height_(0)
+            {
+            }
+
+            // zero filled
+            Plane(size_t row_bytes, uint32_t height)
+                : Plane()
+            {
+                allocate(row_bytes, height);
+                memset(data_, 0, size());
+            }
+
+            Plane(const Plane& y)
+                : Plane()
+            {
+                *this = y;
+            }
+
+            Plane(Plane&& y)
+                : Plane()
+            {
+                *this = std::move(y);
+            }
+
+            Plane& operator = (const Plane& y)
+            {
+                if (this != &y)
+                {
+                    allocate(y.row_bytes_, y.height_);
+                    if (size())
+                        memcpy(data_, y.data_, size());
+                }
+                return *this;
+            }
+
+            Plane& operator = (Plane&& y)
+            {
+                storage_ = std::move(y.storage_);
+                data_ = y.data_;
+                row_bytes_ = y.row_bytes_;
+                stride_ = y.stride_;
+                height_ = y.height_;
+                y.data_ = nullptr;
+                y.row_bytes_ = y.stride_ = 0;
+                y.height_ = 0;
+                return *this;
+            }
+
+            // contents are left uninitialized
+            void allocate(size_t row_bytes, uint32_t height)
+            {
+                size_t stride = (row_bytes + alignment-1)/alignment*alignment;
+                if (stride*height != size() || !storage_)
+                {
+                    storage_.reset(new char[stride*height + alignment]);
+                    uintptr_t p = reinterpret_cast<uintptr_t>(storage_.get());
+                    data_ = reinterpret_cast<char*>((p + alignment-1)/alignment*alignment);
+                }
+                row_bytes_ = row_bytes;
+                stride_ = stride;
+                height_ = height;
+            }
+
+            void clear()
+            {
+                *this = Plane();
+            }
+
+            size_t row_bytes() const { return row_bytes_; }
+            size_t stride() const { return stride_; }
+            uint32_t height() const { return height_; }
+            size_t size() const { return stride_*height_; }
+            bool empty() const { return height_ == 0; }
+
+            char* data() { return data_; }
+            const char* data() const { return data_; }
+            char* row(uint32_t y) { return data_ + y*stride_; }
+            const char* row(uint32_t y) const { return data_ + y*stride_; }
+
+            Span<char> operator [] (uint32_t y) { return Span<char>(row(y), row_bytes_); }
+            Span<const char> operator [] (uint32_t y) const { return Span<const char>(row(y), row_bytes_); }
+
+            // Row y as samples of T: uint8_t, uint16_t or float for 8, 16
+            // and 32 bit channels. Samples are in host byte order.
+            template <typename T>
+            Span<T> row_as(uint32_t y) { return Span<T>(reinterpret_cast<T*>(row(y)), row_bytes_/sizeof(T)); }
+            template <typename T>
+            Span<const T> row_as(uint32_t y) const { return Span<const T>(reinterpret_cast<const T*>(row(y)), row_bytes_/sizeof(T)); }
+
+        private:
+            std::unique_ptr<char[]> storage_;
+            char* data_;
+            size_t row_bytes_;
+            size_t stride_;
+            uint32_t height_;
+    };
+
+    // Samples of one channel in tile_size x tile_size tiles, row by row.
+    // A tile whose samples are all equal is kept as that single value, so
+    // transparent or flat areas take no memory; other tiles are stored
+    // whole, edge tiles included.
+    class TiledPlane
+    {
+        public:
+            static const uint32_t tile_size = 64;
+
+            TiledPlane()
+                : width_(0), height_(0), sample_size_(0), tiles_x_(0)
+            {
+            }
+
+            // every tile constant zero
+            void reset(uint32_t width, uint32_t height, unsigned sample_size);
+            void clear() { *this = TiledPlane(); }
+
+            uint32_t width() const { return width_; }
+            uint32_t height() const { return height_; }
+            unsigned sample_size() const { return sample_size_; }
+            uint32_t tiles_x() const { return tiles_x_; }
+            uint32_t tiles_y() const { return (height_ + tile_size-1)/tile_size; }
+            bool empty() const { return tiles_.empty(); }
+
+            bool is_constant(uint32_t tx, uint32_t ty) const { return tile(tx, ty).pixels.empty(); }
+            // value of a constant tile, sample_size bytes in host order
+            const char* value(uint32_t tx, uint32_t ty) const { return tile(tx, ty).value; }
+            // row y (within the tile) of a stored tile
+            const char* tile_row(uint32_t tx, uint32_t ty, uint32_t y) const { return tile(tx, ty).pixels.data() + (size_t)y*tile_size*sample_size_; }
+
+            // Copies count samples of row y starting at x to dst.
+            void read_row(uint32_t y, uint32_t x, uint32_t count, char* dst) const;
+            // The part of row y inside tile column tx: the row of a stored
+            // tile in place, or fill holding the value of a constant tile.
+            // fill is only rewritten when the value changes, so a run of
+            // constant tiles costs one fill.
+            const char* segment(uint32_t tx, uint32_t y, std::vector<char>& fill) const;
+            // Set the part of row y inside tile column tx to samples, or to
+            // value repeated; within a tile, rows have to be written top to
+            // bottom, the first one resetting it. Uniform parts keep the
+            // tile constant.
+            void write_segment(uint32_t tx, uint32_t y, const char* samples);
+            void fill_segment(uint32_t tx, uint32_t y, const char* value);
+            void write_row(uint32_t y, const char* row);
+            void to_plane(Plane& plane) const;
+
+            size_t stored_tiles() const;
+            // bytes of pixels held by stored tiles
+            size_t stored_bytes() const { return stored_tiles()*tile_size*tile_size*sample_size_; }
+
+        private:
+            struct Tile
+            {
+                char value[4];
+                std::vector<char> pixels; // empty for a constant tile
+            };
+
+            const Tile& tile(uint32_t tx, uint32_t ty) const { return tiles_[(size_t)ty*tiles_x_ + tx]; }
+            uint32_t segment_width(uint32_t tx) const { return std::min(tile_size, width_ - tx*tile_size); }
+
+            uint32_t width_;
+            uint32_t height_;
+            unsigned sample_size_;
+            uint32_t tiles_x_;
+            std::vector<Tile> tiles_;
+    };
+
+    // Sequential reader the parser runs on. Memory backed readers (a span or
+    // a mapped file) read in place; a std::istream is read through a large
+    // chunk buffer so that the many small reads of the parser stay inline.
+    // Positions are absolute offsets in the document.
+    class ByteReader
+    {
+        public:
+            // With an owner, read_buffer hands out views that keep it alive;
+            // without one the bytes are copied.
+            ByteReader(const char* data, size_t size, std::shared_ptr<const void> owner = nullptr)
+                : begin_(data), cur_(data), end_(data + size), base_(0),
+                  stream_(nullptr), owner_(std::move(owner)), ok_(true), psb_(false)
+            {
+            }
+
+            explicit ByteReader(std::istream& stream, size_t chunk_size = 1 << 20);
+
+            uint64_t tell() const { return base_ + (cur_ - begin_); }
+            bool good() const { return ok_; }
+            explicit operator bool() const { return ok_; }
+
+            bool read(void* dst, size_t n)
+            {
+                // empty payloads may come with a null dst or cur_
+                if (n == 0)
+                    return true;
+                if ((size_t)(end_ - cur_) >= n)
+                {
+                    memcpy(dst, cur_, n);
+                    cur_ += n;
+                    return true;
+                }
+                return read_slow((char*)dst, n);
+            }
+
+            template <typename T>
+            T read_be()
+            {
+                be<T> x;
+                read(&x, sizeof(T));
+                return x;
+            }
+
+            // Section and channel lengths are 8 bytes wide in PSB documents.
+            uint64_t read_length()
+            {
+                return psb_ ? read_be<uint64_t>() : read_be<uint32_t>();
+            }
+
+            // Set from the header version; selects the PSB (version 2)
+            // widths of lengths and PackBits row tables.
+            bool psb() const { return psb_; }
+            void set_psb(bool psb) { psb_ = psb; }
+
+            bool skip(uint64_t n)
+            {
+                if ((uint64_t)(end_ - cur_) >= n)
+                {
+                    cur_ += n;
+                    return true;
+                }
+                return seek(tell() + n);
+            }
+
+            bool seek(uint64_t pos);
+            // Reads n bytes into b, as a view when the reader has an owner.
+            bool read_buffer(Buffer& b, size_t n);
+
+        private:
+            bool read_slow(char* dst, size_t n);
+            bool fill();
+
+            const char* begin_;
+            const char* cur_;
+            const char* end_;
+            uint64_t base_; // position of begin_
+            std::istream* stream_;
+            std::vector<char> chunk_;
+            std::shared_ptr<const void> owner_;
+            bool ok_;
+            bool psb_;
+    };
+
     enum class ColorMode : uint16_t
     {
         Bitmap = 0,
@@ -156,7 +629,7 @@ namespace psd
         Lab = 9,
     };
 
-#pragma pack(push, 1)
+    // 26 bytes in the file; read and written field by field
     struct Header
     {
         Header()
@@ -179,10 +652,10 @@ namespace psd
         be<uint16_t> image_resource_id;
         std::string name; // encoded as pascal string; 1 byte length header
 
-        std::vector<char> buffer;
+        Buffer buffer;
 
         uint32_t size() const;
-        bool read(std::istream& stream);
+        bool read(ByteReader& stream);
         bool write(std::ostream& stream);
     };
     
@@ -190,37 +663,232 @@ namespace psd
     {
         Signature signature;
         Signature key;
-        be<uint32_t> length;
-        std::vector<char> data;
+        be<uint64_t> length;
+        Buffer data;
 
-        uint32_t size() const { return 12+data.size() + (data.size()%2); }
-        bool read(std::istream& stream);
-        bool write(std::ostream& stream);
+        // A few keys carry 8 byte lengths in PSB documents.
+        bool has_long_length(bool psb) const;
+        uint64_t size(bool psb = false) const { return (has_long_length(psb) ? 16 : 12) + data.size() + (data.size()%2); }
+        bool read(ByteReader& stream);
+        bool write(std::ostream& stream, bool psb = false);
 
         void luni_read_name(std::wstring& wname, std::string& utf8name);
     };
 
+    // Fixed set of worker threads for data parallel loops.
+    class ThreadPool
+    {
+        public:
+            // threads counts the calling thread; 0 uses every hardware thread
+            explicit ThreadPool(unsigned threads = 0);
+            ~ThreadPool();
+
+            unsigned size() const;
+            // Calls f(i) for every i in [0, count) on the workers and the
+            // calling thread and returns once all calls have finished. Must
+            // not be called from inside f.
+            void parallel_for(size_t count, const std::function<void(size_t)>& f);
+
+        private:
+            ThreadPool(const ThreadPool&) = delete;
+            ThreadPool& operator = (const ThreadPool&) = delete;
+
+            struct Impl;
+            std::unique_ptr<Impl> impl_;
+    };
+
+    struct LoadOptions
+    {
+        LoadOptions()
+            : lazy(false), skip_images(false), threads(1), tiled(false)
+        {}
+        // Only keep the compressed channel payloads while loading; pixels
+        // are decoded when first requested (see ImageData::decode). The
+        // payloads are views into the file with load_mapped (or a
+        // ByteReader with an owner) but copies when loading from a
+        // std::istream, which the document cannot keep open: there lazy
+        // saves the decoding and the decoded planes, not the compressed
+        // bytes.
+        bool lazy;
+        // Stop after the layer records; channel data, the global layer mask
+        // and the merged image are skipped (see psd::scan).
+        bool skip_images;
+        // Number of threads decoding channels; 0 uses every hardware thread.
+        // With more than one, all compressed payloads are read first and
+        // then decoded concurrently.
+        unsigned threads;
+        // Decode layer channels into ImageData::tiles instead of data (see
+        // ImageData::decode_tiled). Has no effect with lazy.
+        bool tiled;
+        // Path of a group or layer (see LayerTree::find), e.g.
+        // "characters/hero". When set, only the channels of its layers are
+        // decoded; the other layers and the merged image are kept
+        // compressed as with lazy. Loading fails if there is no such path.
+        std::string subtree;
+    };
+
+    // PackBits codec for a single row. PackBitCompress appends to output,
+    // or writes to a buffer of at least PackBitCompressBound(input_size)
+    // bytes; either way it returns the encoded size. PackBitDecompress
+    // fills exactly dst_size bytes and fails on truncated or overlong input.
+    inline size_t PackBitCompressBound(size_t input_size) { return input_size + (input_size + 127)/128; }
+    size_t PackBitCompress(const char* input, size_t input_size, char* output);
+    size_t PackBitCompress(const char* input, size_t input_size, std::vector<char>& output);
+    bool PackBitDecompress(const char* src, size_t src_size, char* dst, size_t dst_size);
+
+    // Values of ImageData::compression_method.
+    enum class Compression : uint16_t
+    {
+        Raw = 0,
+        PackBits = 1,
+        Zip = 2,
+        ZipPrediction = 3,
+    };
+
+    // Interleaved layouts written by MultipleImageData::interleave and
+    // Layer::interleave; the value is the number of samples per pixel.
+    enum class PixelFormat
+    {
+        Gray = 1,
+        GrayAlpha = 2,
+        RGB = 3,
+        RGBA = 4,
+    };
+    inline unsigned channel_count(PixelFormat format) { return (unsigned)format; }
+
+    // Interleaves count (1 to 4) planes of w samples of sample_size bytes
+    // (1, 2 or 4) into dst, count samples per pixel. 8 bit samples use
+    // SSE2, and SSSE3 (RGB) or AVX2 (RGBA) where the CPU has them.
+    void interleave_row(const char* const* planes, unsigned count, size_t w, unsigned sample_size, char* dst);
+
+    struct SaveOptions
+    {
+        SaveOptions()
+            : threads(1), compression(Compression::PackBits), zip_level(6)
+        {}
+        // Number of threads compressing rows; 0 uses every hardware thread.
+        // ZIP channels are deflated whole, so channels run in parallel
+        // instead.
+        unsigned threads;
+        // Encoding of layer channels. PackBits falls back to raw where that
+        // is smaller; the merged image is always PackBits (or raw).
+        Compression compression;
+        // deflate level for Zip and ZipPrediction: 0 (store) to 10 (best)
+        int zip_level;
+    };
+
+    struct CompositeOptions
+    {
+        CompositeOptions()
+            : threads(1), tile_size(128), use_masks(true)
+        {}
+        // Number of threads compositing tiles; 0 uses every hardware thread.
+        unsigned threads;
+        // Tiles are tile_size pixels square and composited independently.
+        uint32_t tile_size;
+        // Apply enabled user masks (-2) of layers and groups.
+        bool use_masks;
+    };
+
     struct ImageData
     {
+        ImageData()
+            : w(0), h(0), bit_depth(8), decoded(false), psb(false)
+        {}
         uint32_t w;
         uint32_t h;
-        be<uint16_t> compression_method;
-        std::vector<std::vector<char>> data;
-        bool read(std::istream& f, uint32_t w, uint32_t h);
-        bool write(std::ostream& f);
+        uint16_t bit_depth; // 8, 16 or 32 (float)
+        be<uint16_t> compression_method; // 0 raw, 1 PackBits, 2 ZIP, 3 ZIP with prediction
+        Plane data; // valid once decoded, unless tiled
+        TiledPlane tiles; // pixels instead of data once decode_tiled
+        Buffer packed; // compressed payload following compression_method
+        bool decoded;
+        bool psb; // PackBits row lengths in packed are 4 bytes wide
+        size_t row_bytes() const { return (size_t)w*bit_depth/8; }
+        bool tiled() const { return !tiles.empty(); }
+        // length is the channel length including the compression method,
+        // as in Layer::channel_infos; ZIP payloads cannot be read without it.
+        bool read(ByteReader& f, uint32_t w, uint32_t h, bool lazy = false, uint16_t bit_depth = 8, uint64_t length = 0);
+        bool write(std::ostream& f, ThreadPool* pool = nullptr);
+        // Compresses data into packed as options.compression asks (unless
+        // it was never decoded and already compressed that way) and returns
+        // the size write_encoded will produce. PackBits rows are compressed
+        // in parallel when a pool is given.
+        uint64_t encode(ThreadPool* pool = nullptr, const SaveOptions& options = SaveOptions());
+        // Switches the row table format encode and write produce, converting
+        // a payload that was never decoded in place.
+        void set_psb(bool psb);
+        bool write_encoded(std::ostream& f);
 
-        bool read_with_method(std::istream& f, uint32_t w, uint32_t h, uint16_t compression_method);
+        bool read_with_method(ByteReader& f, uint32_t w, uint32_t h, uint16_t compression_method, bool lazy = false, uint16_t bit_depth = 8, uint64_t payload_size = 0);
+        // payload_size is only used for ZIP (methods 2 and 3), which unlike
+        // raw and PackBits data does not tell its own length.
+        bool read_packed(ByteReader& f, uint64_t payload_size = 0);
+        // Decodes packed into data, converting 16 and 32 bit samples to host
+        // byte order; does nothing if already decoded.
+        bool decode();
+        // Decodes packed, or moves data, into tiles and releases data.
+        // PackBits runs covering a whole tile row are recorded as constant
+        // without writing any samples. Decoded rows are then read with
+        // decoded_row; untile moves them back to data.
+        bool decode_tiled();
+        void untile();
+        // Row y of a decoded channel: in data, or assembled into scratch
+        // from tiles.
+        const char* decoded_row(uint32_t y, std::vector<char>& scratch) const;
+        // Samples of row y from x up to the end of x's tile when tiled (x
+        // then a multiple of TiledPlane::tile_size), without copying
+        // stored tiles; see TiledPlane::segment.
+        const char* decoded_segment(uint32_t y, uint32_t x, std::vector<char>& fill) const;
+        // Decodes the width x height rectangle at (left, top) without
+        // decoding the rest of the channel: PackBits rows are found through
+        // the row length table and decoded up to the right edge only, ZIP
+        // data is inflated up to the bottom edge. Copies from data once
+        // decoded. Fails if the rectangle is not inside the channel.
+        bool decode_region(uint32_t left, uint32_t top, uint32_t width, uint32_t height, Plane& out) const;
+        // Same, writing rows stride bytes apart to dst.
+        bool decode_region(uint32_t left, uint32_t top, uint32_t width, uint32_t height, char* dst, size_t stride) const;
+        // Decodes the channel shrunk by 2^shift in both directions into
+        // out, box filtering rows as they are decoded; only one row of the
+        // full resolution image is held at a time. Edge boxes average the
+        // pixels they cover, so out is ceil(w/2^shift) x ceil(h/2^shift).
+        bool decode_scaled(unsigned shift, Plane& out) const;
     };
 
     struct MultipleImageData
     {
+        MultipleImageData()
+            : w(0), h(0), count(0), bit_depth(8), color_mode((uint16_t)ColorMode::RGB), decoded(false), psb(false)
+        {}
         uint32_t w;
         uint32_t h;
         uint32_t count;
+        uint16_t bit_depth;
+        uint16_t color_mode; // header.color_mode, set by psd::load
         be<uint16_t> compression_method;
-        std::vector<std::vector<std::vector<char>>> datas;
-        bool read(std::istream& f, uint32_t w, uint32_t h, uint32_t count, uint16_t bit_depth);
-        bool write(std::ostream& f);
+        std::vector<Plane> datas; // one plane per channel, valid once decoded
+        Buffer packed;
+        bool decoded;
+        bool psb; // see ImageData::psb
+        size_t row_bytes() const { return (size_t)w*bit_depth/8; }
+        bool read(ByteReader& f, uint32_t w, uint32_t h, uint32_t count, uint16_t bit_depth, bool lazy = false);
+        // Rows are coded in parallel when a pool is given.
+        bool write(std::ostream& f, ThreadPool* pool = nullptr);
+        bool decode(ThreadPool* pool = nullptr);
+        // Decodes a rectangle of every channel into out, one plane per
+        // channel; see ImageData::decode_region.
+        bool decode_region(uint32_t left, uint32_t top, uint32_t width, uint32_t height, std::vector<Plane>& out) const;
+        // Downscaled decode of every channel (see ImageData::decode_scaled);
+        // channels are processed in parallel when a pool is given.
+        bool decode_scaled(unsigned shift, std::vector<Plane>& out, ThreadPool* pool = nullptr) const;
+        // Writes the image to dst as w x h pixels of format, rows stride
+        // bytes apart, samples as wide as bit_depth; decodes first if
+        // needed. Only RGB and Grayscale color modes are handled: channels
+        // 0-2 are RGB, or channel 0 is gray and is repeated for RGB; the
+        // next channel is alpha, opaque if there is none. Color cannot be
+        // written as gray.
+        bool interleave(PixelFormat format, char* dst, size_t stride, ThreadPool* pool = nullptr);
+        void set_psb(bool psb);
     };
 
     struct Layer
@@ -228,13 +896,14 @@ namespace psd
         Layer() : has_text(false) {}
         be<uint32_t> top, left, bottom, right;
         be<uint16_t> num_channels;
-        std::vector<std::pair<be<int16_t>, be<uint32_t>>> channel_infos; // ID, length
+        std::vector<std::pair<be<int16_t>, be<uint64_t>>> channel_infos; // ID, length
         std::vector<ImageData> channel_info_data;
+        // Decodes the channel on first access; nullptr if missing or broken.
         ImageData* get_channel_info_by_id(int16_t id)
         {
             for(uint16_t i = 0; i < channel_infos.size(); i ++)
                 if (channel_infos[i].first == id)
-                    return &channel_info_data[i];
+                    return channel_info_data[i].decode() ? &channel_info_data[i] : nullptr;
             return nullptr;
         }
 
@@ -258,8 +927,11 @@ namespace psd
             uint8_t flags;
             std::vector<char> additional_data;
 
-            bool read(std::istream& f);
+            bool read(ByteReader& f);
             bool write(std::ostream& f);
+            // Bounds of the real user mask (-3), the last 16 bytes of
+            // records longer than 20 bytes; false if there are none.
+            bool real_rect(int32_t& top, int32_t& left, int32_t& bottom, int32_t& right) const;
 
         } mask;
 
@@ -267,7 +939,7 @@ namespace psd
         {
             uint32_t size() const { return data.size() + 4; }
             std::vector<char> data;
-            bool read(std::istream& f);
+            bool read(ByteReader& f);
             bool write(std::ostream& f);
         } blending_ranges;
         std::string name;
@@ -275,10 +947,62 @@ namespace psd
         std::string utf8name;
         bool has_text;
 
-        bool read(std::istream& f);
-        bool write(std::ostream& f);
-        bool read_images(std::istream& f);
+        bool read(ByteReader& f);
+        // Writes the record with the current channel_infos lengths; psb
+        // selects the version 2 layout.
+        bool write(std::ostream& f, bool psb = false);
+        void write_channel_infos(std::ostream& f, bool psb = false);
+        uint64_t record_size(bool psb = false);
+        // tiled decodes channels with ImageData::decode_tiled (unless lazy).
+        bool read_images(ByteReader& f, bool lazy = false, uint16_t bit_depth = 8, bool tiled = false);
+        // Encodes every channel, updating channel_infos; returns the total.
+        uint64_t encode_images(ThreadPool* pool = nullptr, bool psb = false, const SaveOptions& options = SaveOptions());
         bool write_images(std::ostream& f);
+        bool decode_images();
+        // Decodes the width x height rectangle at (left, top) in document
+        // coordinates of channel id into out; the parts outside the channel
+        // are zero. The user mask (-2) and real user mask (-3) lie at their
+        // own rectangles, the others at the layer bounds. False if there is
+        // no such channel or it is broken.
+        bool decode_region(int16_t id, int32_t left, int32_t top, uint32_t width, uint32_t height, Plane& out) const;
+        // Decodes channel id shrunk by 2^shift; see ImageData::decode_scaled.
+        bool decode_scaled(int16_t id, unsigned shift, Plane& out) const;
+        // Writes the layer (right-left x bottom-top pixels) to dst as
+        // MultipleImageData::interleave does, from channels 0-2; alpha is
+        // the transparency channel (-1), multiplied by the user mask (-2)
+        // when use_mask is set and the mask is enabled.
+        bool interleave(PixelFormat format, char* dst, size_t stride, bool use_mask = true);
+    };
+
+    // The groups the section divider extra data (lsct, or lsdk when nested
+    // deeply) describes. Layers are stored bottom to top, a group as a
+    // hidden divider record, its children and then the record holding its
+    // name and properties; nodes are indexed like the layers.
+    struct LayerTree
+    {
+        struct Node
+        {
+            Node() : type(0), parent(-1), first(0) {}
+            // 0 layer, 1 open group, 2 closed group, 3 divider; unmatched
+            // dividers and group records are 0
+            int type;
+            // the enclosing group, -1 at the top level; a divider has its
+            // own group as parent but is not one of its children
+            int32_t parent;
+            // first layer of the subtree: the divider of a group, else the
+            // layer itself
+            size_t first;
+            std::vector<size_t> children; // bottom to top
+        };
+        std::vector<Node> nodes;
+        std::vector<size_t> roots; // top level, bottom to top
+
+        void build(const std::vector<Layer>& layers);
+        bool is_group(size_t index) const { return nodes[index].type == 1 || nodes[index].type == 2; }
+        // The layer or group at a path of utf8 names separated by '/',
+        // starting at the top level; of siblings with the same name the
+        // topmost. -1 if there is none.
+        int32_t find(const std::vector<Layer>& layers, const std::string& path) const;
     };
 
     struct LayerInfo
@@ -289,9 +1013,18 @@ namespace psd
         be<int16_t> num_layers;
         bool has_merged_alpha_channel;
         std::vector<Layer> layers;
+        // built by read; call tree.build(layers) after changing the layers
+        LayerTree tree;
 
-        bool read(std::istream& stream);
-        bool write(std::ostream& stream);
+        bool read(ByteReader& stream, const LoadOptions& options = LoadOptions(), uint16_t bit_depth = 8);
+        // On seekable streams channels are encoded and written one layer at
+        // a time and the lengths patched afterwards; otherwise everything is
+        // encoded first (see encode / write_encoded).
+        bool write(std::ostream& stream, ThreadPool* pool = nullptr, bool psb = false, const SaveOptions& options = SaveOptions());
+        // Encodes all channels; returns the section size including its length field.
+        uint64_t encode(ThreadPool* pool = nullptr, bool psb = false, const SaveOptions& options = SaveOptions());
+        bool write_encoded(std::ostream& stream, uint64_t size, bool psb = false);
+        bool write_header(std::ostream& stream);
     };
 
     struct GlobalLayerMaskInfo
@@ -303,12 +1036,11 @@ namespace psd
         uint8_t kind;
         std::vector<char> data;
 
-        bool read(std::istream& stream);
+        uint32_t size() const { return 4 + (length ? 2+2*4+2+1 + data.size() : 0); }
+        bool read(ByteReader& stream);
         bool write(std::ostream& stream);
     };
 
-#pragma pack(pop)
-
     class psd
     {
         public:
@@ -319,8 +1051,37 @@ namespace psd
                 load(stream);
             }
 
-            bool load(std::istream& stream);
-            bool save(std::ostream& f);
+            bool load(std::istream& stream, const LoadOptions& options = LoadOptions());
+            bool load(ByteReader& reader, const LoadOptions& options = LoadOptions());
+            // Maps the file into memory; image resources, extra data and
+            // compressed channel payloads refer to the mapping instead of
+            // being copied.
+            bool load_mapped(const char* path, const LoadOptions& options = LoadOptions());
+            // Reads only the header, image resources and layer records
+            // (names, bounds, flags); no pixel data is available afterwards
+            // and the document cannot be saved.
+            bool scan(std::istream& stream);
+            bool scan_mapped(const char* path);
+            // Writes the large document format (PSB) when header.version is
+            // 2, which documents over 30000 pixels wide or high require.
+            bool save(std::ostream& f, const SaveOptions& options = SaveOptions());
+            // Flattens the visible layers into RGBA pixels, 8 bits per
+            // sample with straight alpha, rows stride bytes apart; for the
+            // width x height rectangle at (left, top) of the document, or
+            // the whole document. Follows blend modes, opacity and fill
+            // opacity, clipping (to layers and, as in Photoshop, to the
+            // result of groups), groups (pass through or isolated) and user
+            // masks; adjustment layers and layer effects are not rendered.
+            // RGB and grayscale documents only.
+            bool composite(char* dst, size_t stride, const CompositeOptions& options = CompositeOptions());
+            bool composite(uint32_t left, uint32_t top, uint32_t width, uint32_t height, char* dst, size_t stride, const CompositeOptions& options = CompositeOptions());
+            // Composites only the subtree of layers()[index] (a group or a
+            // single layer, see LayerTree) as if it were alone, decoding
+            // nothing else. It is drawn even when hidden; its blend mode,
+            // opacity and mask apply. The second form fills out with the
+            // part of the document the subtree covers, at (left, top).
+            bool composite_subtree(size_t index, uint32_t left, uint32_t top, uint32_t width, uint32_t height, char* dst, size_t stride, const CompositeOptions& options = CompositeOptions());
+            bool composite_subtree(size_t index, Plane& out, uint32_t& left, uint32_t& top, const CompositeOptions& options = CompositeOptions());
 
             Header header;
 
@@ -335,20 +1096,65 @@ namespace psd
 
             operator bool();
         private:
-            bool read_header(std::istream& f);
-            bool read_color_mode(std::istream& f);
-            bool read_image_resources(std::istream& f);
-            bool read_layers_and_masks(std::istream& f);
+            bool read_header(ByteReader& f);
+            bool read_color_mode(ByteReader& f);
+            bool read_image_resources(ByteReader& f);
+            bool read_layers_and_masks(ByteReader& f, const LoadOptions& options);
+
+            bool read_layer_info(ByteReader& f);
+            bool decode_parallel(const LoadOptions& options);
 
-            bool read_layer_info(std::istream& f);
 
             bool write_header(std::ostream& f);
             bool write_color_mode(std::ostream& f);
             bool write_image_resources(std::ostream& f);
-            bool write_layers_and_masks(std::ostream& f);
+            bool write_layers_and_masks(std::ostream& f, ThreadPool* pool, const SaveOptions& options);
 
             bool valid_;
+            bool scanned_;
+
+    };
 
+    // Keeps the composite of a document (see psd::composite) and on update
+    // recomposites only the tiles marked dirty since the last one. Refers
+    // to the document, which must outlive it.
+    class Compositor
+    {
+        public:
+            struct Rect
+            {
+                int32_t left, top, right, bottom;
+            };
+
+            explicit Compositor(psd& document, const CompositeOptions& options = CompositeOptions());
+            ~Compositor();
+
+            // Marks the tiles touching a rectangle of the document dirty.
+            void invalidate(int32_t left, int32_t top, uint32_t width, uint32_t height);
+            void invalidate(const Rect& r);
+            // Call after changing layers()[index]: marks what it covered at
+            // the last update and what it covers now dirty, taking its
+            // bounds, its mask and for a group everything inside.
+            void invalidate_layer(size_t index);
+            void invalidate_all();
+            // Recomposites the dirty tiles; everything the first time and
+            // after the document size or the number of layers changed.
+            bool update();
+            // header.width x header.height pixels of 8 bit RGBA
+            const Plane& pixels() const { return pixels_; }
+
+        private:
+            Compositor(const Compositor&) = delete;
+            Compositor& operator = (const Compositor&) = delete;
+
+            psd& document_;
+            CompositeOptions options_;
+            std::unique_ptr<ThreadPool> pool_;
+            Plane pixels_;
+            uint32_t tiles_x_;
+            std::vector<uint8_t> dirty_; // per tile, row by row
+            std::vector<Rect> extents_; // of every layer at the last update
+            bool valid_;
     };
 
 }
@@ -0,0 +1,1057 @@
+#include "psd.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <random>
+
+// Documents are built in memory, saved, loaded back and compared. Exits
+// with the number of failed checks.
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            cout << __FILE__ << ':' << __LINE__ << ": " << #cond << endl; \
+            failures ++; \
+        } \
+    } while(0)
+
+enum class Fill { Flat, Gradient, Noise };
+
+static mt19937 rng(1);
+
+static void fill_plane(psd::Plane& plane, uint32_t w, uint32_t h, uint16_t bit_depth, Fill fill)
+{
+    plane.allocate((size_t)w*bit_depth/8, h);
+    uint32_t seed = rng();
+    for(uint32_t y = 0; y < h; y ++)
+    {
+        for(uint32_t x = 0; x < w; x ++)
+        {
+            uint32_t v = fill == Fill::Flat ? seed : fill == Fill::Gradient ? x*7 + y*3 + seed : (uint32_t)rng();
+            char* p = plane.row(y) + (size_t)x*bit_depth/8;
+            if (bit_depth == 8)
+            {
+                *p = (char)v;
+            }
+            else if (bit_depth == 16)
+            {
+                uint16_t s = (uint16_t)v;
+                memcpy(p, &s, 2);
+            }
+            else
+            {
+                float s = (v%4096)/4095.0f;
+                memcpy(p, &s, 4);
+            }
+        }
+    }
+}
+
+static psd::psd make_document(uint32_t w, uint32_t h, uint16_t bit_depth, Fill fill)
+{
+    psd::psd doc;
+    doc.header.signature = psd::Signature("8BPS");
+    doc.header.version = 1;
+    doc.header.num_channels = 3;
+    doc.header.width = w;
+    doc.header.height = h;
+    doc.header.bit_depth = bit_depth;
+    doc.header.color_mode = (uint16_t)psd::ColorMode::RGB;
+    doc.global_layer_mask_info.length = 0;
+    psd::MultipleImageData& merged = doc.merged_image;
+    merged.w = w;
+    merged.h = h;
+    merged.count = 3;
+    merged.bit_depth = bit_depth;
+    merged.datas.resize(3);
+    for(auto& plane:merged.datas)
+        fill_plane(plane, w, h, bit_depth, fill);
+    merged.decoded = true;
+    return doc;
+}
+
+// A stream buffer that cannot seek, so that save takes its buffered paths.
+class UnseekableBuf : public std::stringbuf
+{
+    protected:
+        pos_type seekoff(off_type, std::ios_base::seekdir, std::ios_base::openmode) override { return pos_type(off_type(-1)); }
+        pos_type seekpos(pos_type, std::ios_base::openmode) override { return pos_type(off_type(-1)); }
+};
+
+static string save(psd::psd& doc, bool seekable, const psd::SaveOptions& options = psd::SaveOptions())
+{
+    if (seekable)
+    {
+        ostringstream out;
+        CHECK(doc.save(out, options));
+        return out.str();
+    }
+    UnseekableBuf buf;
+    ostream out(&buf);
+    CHECK(doc.save(out, options));
+    return buf.str();
+}
+
+static bool load(psd::psd& doc, const string& bytes, const psd::LoadOptions& options = psd::LoadOptions())
+{
+    istringstream in(bytes);
+    return doc.load(in, options);
+}
+
+static bool same_planes(const psd::Plane& a, const psd::Plane& b)
+{
+    if (a.row_bytes() != b.row_bytes() || a.height() != b.height())
+        return false;
+    for(uint32_t y = 0; y < a.height(); y ++)
+        if (memcmp(a.row(y), b.row(y), a.row_bytes()) != 0)
+            return false;
+    return true;
+}
+
+static psd::Layer make_layer(int32_t left, int32_t top, uint32_t w, uint32_t h, uint16_t bit_depth, Fill fill)
+{
+    psd::Layer layer;
+    layer.left = left;
+    layer.top = top;
+    layer.right = left + w;
+    layer.bottom = top + h;
+    layer.blend_signature = psd::Signature("8BIM");
+    layer.blend_key = 0x6e6f726d; // norm
+    layer.opacity = 255;
+    layer.clipping = 0;
+    layer.bit_flags = 0;
+    layer.dummy1 = 0;
+    layer.mask.length = 0;
+    layer.name = "layer";
+    for(int16_t id = -1; id < 3; id ++)
+    {
+        psd::ImageData channel;
+        channel.w = w;
+        channel.h = h;
+        channel.bit_depth = bit_depth;
+        fill_plane(channel.data, w, h, bit_depth, fill);
+        channel.decoded = true;
+        layer.channel_infos.emplace_back(id, 0);
+        layer.channel_info_data.push_back(std::move(channel));
+    }
+    layer.num_channels = layer.channel_infos.size();
+    return layer;
+}
+
+static void add_layers(psd::psd& doc)
+{
+    uint32_t w = doc.header.width;
+    uint32_t h = doc.header.height;
+    uint16_t bit_depth = doc.header.bit_depth;
+    doc.layers().push_back(make_layer(0, 0, w, h, bit_depth, Fill::Gradient));
+    doc.layers().push_back(make_layer(-3, 5, w/2, h/3, bit_depth, Fill::Noise));
+    doc.layers().push_back(make_layer(w/4, h/4, w/2 + 1, h/2 + 1, bit_depth, Fill::Flat));
+    doc.layer_info.num_layers = doc.layers().size();
+}
+
+static bool same_layers(psd::psd& a, psd::psd& b)
+{
+    if (a.layers().size() != b.layers().size())
+        return false;
+    for(size_t i = 0; i < a.layers().size(); i ++)
+    {
+        psd::Layer& la = a.layers()[i];
+        psd::Layer& lb = b.layers()[i];
+        if (la.left != lb.left || la.top != lb.top || la.right != lb.right || la.bottom != lb.bottom ||
+            la.channel_infos.size() != lb.channel_infos.size())
+            return false;
+        for(size_t c = 0; c < la.channel_infos.size(); c ++)
+        {
+            psd::ImageData* ca = la.get_channel_info_by_id(la.channel_infos[c].first);
+            psd::ImageData* cb = lb.get_channel_info_by_id(la.channel_infos[c].first);
+            if (!ca || !cb || !same_planes(ca->data, cb->data))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Merged image: seekable and buffered saves agree, and PackBits is only
+// used when it is smaller than raw.
+static void test_merged_image()
+{
+    for(Fill fill:{Fill::Flat, Fill::Gradient, Fill::Noise})
+    {
+        psd::psd doc = make_document(67, 45, 8, fill);
+        string seekable = save(doc, true);
+        string buffered = save(doc, false);
+        CHECK(seekable == buffered);
+
+        psd::psd loaded;
+        CHECK(load(loaded, seekable));
+        if (fill != Fill::Gradient)
+            CHECK(loaded.merged_image.compression_method == (fill == Fill::Flat ? 1 : 0));
+        for(int c = 0; c < 3; c ++)
+            CHECK(same_planes(loaded.merged_image.datas[c], doc.merged_image.datas[c]));
+    }
+}
+
+// Rows compressed on several threads come out as on one, on seekable and
+// buffered streams alike, and load back unchanged.
+static void test_parallel_save()
+{
+    psd::psd doc = make_document(300, 200, 8, Fill::Gradient);
+    add_layers(doc);
+    psd::SaveOptions options;
+    string expected = save(doc, true, options);
+    for(unsigned threads:{1u, 3u})
+    {
+        options.threads = threads;
+        CHECK(save(doc, true, options) == expected);
+        CHECK(save(doc, false, options) == expected);
+    }
+
+    psd::psd loaded;
+    CHECK(load(loaded, expected));
+    CHECK(same_layers(loaded, doc));
+    psd::LoadOptions load_options;
+    load_options.threads = 3;
+    psd::psd parallel;
+    CHECK(load(parallel, expected, load_options));
+    CHECK(same_layers(parallel, doc));
+    CHECK(save(parallel, true) == expected);
+}
+
+// Layers of 16 and 32 bit documents go to an Lr16 or Lr32 tagged block, as
+// Photoshop writes them, and are read back from there.
+static void test_deep_layers()
+{
+    for(uint16_t bit_depth:{16, 32})
+    {
+        psd::psd doc = make_document(40, 30, bit_depth, Fill::Gradient);
+        add_layers(doc);
+        string seekable = save(doc, true);
+        string buffered = save(doc, false);
+        CHECK(seekable == buffered);
+        CHECK(seekable.find(bit_depth == 16 ? "8BIMLr16" : "8BIMLr32") != string::npos);
+
+        psd::psd loaded;
+        CHECK(load(loaded, seekable));
+        CHECK(same_layers(loaded, doc));
+        CHECK(loaded.additional_layer_data.empty());
+        CHECK(save(loaded, true) == seekable);
+
+        psd::LoadOptions scan;
+        scan.skip_images = true;
+        psd::psd scanned;
+        CHECK(load(scanned, seekable, scan));
+        CHECK(scanned.layers().size() == doc.layers().size());
+    }
+}
+
+// Rows of a PSD that pack to more than 0xffff bytes do not fit its 16 bit
+// row lengths, so such channels are stored raw.
+static void test_long_rows()
+{
+    for(bool long_row:{false, true})
+    {
+        psd::psd doc = make_document(20000, 4, 32, Fill::Flat);
+        doc.layers().push_back(make_layer(0, 0, 20000, 4, 32, Fill::Flat));
+        doc.layer_info.num_layers = 1;
+        // zeros, as flat floats have no byte runs for PackBits
+        for(auto& plane:doc.merged_image.datas)
+            for(uint32_t y = 0; y < plane.height(); y ++)
+                memset(plane.row(y), 0, plane.row_bytes());
+        for(auto& channel:doc.layers()[0].channel_info_data)
+            for(uint32_t y = 0; y < channel.data.height(); y ++)
+                memset(channel.data.row(y), 0, channel.data.row_bytes());
+        if (long_row)
+        {
+            char* merged_row = doc.merged_image.datas[0].row(1);
+            char* layer_row = doc.layers()[0].channel_info_data[1].data.row(1);
+            for(size_t x = 0; x < doc.merged_image.datas[0].row_bytes(); x ++)
+                merged_row[x] = layer_row[x] = (char)rng();
+        }
+        string seekable = save(doc, true);
+        CHECK(seekable == save(doc, false));
+
+        psd::psd loaded;
+        CHECK(load(loaded, seekable));
+        CHECK(loaded.merged_image.compression_method == (long_row ? 0 : 1));
+        CHECK(loaded.layers()[0].channel_info_data[1].compression_method == (long_row ? 0 : 1));
+        CHECK(same_layers(loaded, doc));
+        for(int c = 0; c < 3; c ++)
+            CHECK(same_planes(loaded.merged_image.datas[c], doc.merged_image.datas[c]));
+    }
+}
+
+// Layer channels saved with ZIP, with and without prediction, load back
+// unchanged at every depth, serially and on several threads.
+static void test_zip()
+{
+    for(uint16_t bit_depth:{8, 16, 32})
+    {
+        psd::psd doc = make_document(53, 37, bit_depth, Fill::Gradient);
+        add_layers(doc);
+        for(psd::Compression compression:{psd::Compression::Zip, psd::Compression::ZipPrediction})
+        {
+            psd::SaveOptions options;
+            options.compression = compression;
+            string expected = save(doc, true, options);
+            CHECK(save(doc, false, options) == expected);
+            options.threads = 3;
+            CHECK(save(doc, true, options) == expected);
+
+            psd::psd loaded;
+            CHECK(load(loaded, expected));
+            CHECK(loaded.layers()[0].channel_info_data[0].compression_method == (uint16_t)compression);
+            CHECK(same_layers(loaded, doc));
+            CHECK(save(loaded, true, options) == expected);
+        }
+    }
+}
+
+static void add_mask_channel(psd::Layer& layer, int16_t id, uint32_t w, uint32_t h)
+{
+    psd::ImageData channel;
+    channel.w = w;
+    channel.h = h;
+    channel.bit_depth = 8;
+    fill_plane(channel.data, w, h, 8, Fill::Noise);
+    channel.decoded = true;
+    layer.channel_infos.emplace_back(id, 0);
+    layer.channel_info_data.push_back(std::move(channel));
+    layer.num_channels = layer.channel_infos.size();
+}
+
+// The user mask (-2) and real user mask (-3) are read and decoded at their
+// own rectangles, which differ from the layer bounds.
+static void test_mask_regions()
+{
+    psd::psd doc = make_document(64, 48, 8, Fill::Flat);
+    psd::Layer layer = make_layer(10, 8, 30, 20, 8, Fill::Gradient);
+    layer.mask.length = 36;
+    layer.mask.top = 4;
+    layer.mask.left = 20;
+    layer.mask.bottom = 4 + 17;
+    layer.mask.right = 20 + 25;
+    layer.mask.default_color = 0;
+    layer.mask.flags = 0;
+    // real flags, real background, then the real mask rectangle
+    const uint32_t real[4] = {30, 2, 30 + 9, 2 + 13};
+    layer.mask.additional_data.assign(2, 0);
+    for(uint32_t v:real)
+        for(int shift = 24; shift >= 0; shift -= 8)
+            layer.mask.additional_data.push_back((char)(v >> shift));
+    add_mask_channel(layer, -2, 25, 17);
+    add_mask_channel(layer, -3, 13, 9);
+    doc.layers().push_back(std::move(layer));
+    doc.layer_info.num_layers = 1;
+
+    psd::psd loaded;
+    CHECK(load(loaded, save(doc, true)));
+    CHECK(same_layers(loaded, doc));
+    if (loaded.layers().size() != 1)
+        return;
+    const psd::Layer& l = loaded.layers()[0];
+    psd::Layer& src = doc.layers()[0];
+
+    // a region straddling every channel's rectangle, in document space
+    const int32_t left = 0, top = 0;
+    const uint32_t width = 64, height = 48;
+    struct { int16_t id; int32_t x, y; } channels[] = {{0, 10, 8}, {-2, 20, 4}, {-3, 2, 30}};
+    for(auto& c:channels)
+    {
+        psd::ImageData* expected = src.get_channel_info_by_id(c.id);
+        psd::Plane out;
+        CHECK(l.decode_region(c.id, left, top, width, height, out));
+        bool same = true;
+        for(uint32_t y = 0; y < height; y ++)
+        {
+            for(uint32_t x = 0; x < width; x ++)
+            {
+                int32_t cx = (int32_t)x - c.x, cy = (int32_t)y - c.y;
+                bool inside = cx >= 0 && cy >= 0 && cx < (int32_t)expected->w && cy < (int32_t)expected->h;
+                char want = inside ? expected->data.row(cy)[cx] : 0;
+                if (out.row(y)[x] != want)
+                    same = false;
+            }
+        }
+        CHECK(same);
+    }
+}
+
+static psd::psd with_color_mode(psd::ColorMode mode, uint16_t channels)
+{
+    psd::psd doc = make_document(19, 11, 8, Fill::Noise);
+    doc.header.color_mode = (uint16_t)mode;
+    doc.header.num_channels = channels;
+    doc.merged_image.count = channels;
+    doc.merged_image.datas.resize(channels);
+    for(auto& plane:doc.merged_image.datas)
+        fill_plane(plane, 19, 11, 8, Fill::Noise);
+    psd::psd loaded;
+    CHECK(load(loaded, save(doc, true)));
+    return loaded;
+}
+
+// The merged image is interleaved by its color mode, not by its channel
+// count: CMYK is refused rather than taking K for alpha, and the channels
+// after gray are alpha.
+static void test_interleave_color_mode()
+{
+    vector<char> pixels(19*11*4);
+    psd::psd cmyk = with_color_mode(psd::ColorMode::CMYK, 4);
+    CHECK(!cmyk.merged_image.interleave(psd::PixelFormat::RGBA, pixels.data(), 19*4));
+
+    psd::psd gray = with_color_mode(psd::ColorMode::Grayscale, 3);
+    CHECK(gray.merged_image.interleave(psd::PixelFormat::RGBA, pixels.data(), 19*4));
+    bool same = true;
+    for(uint32_t y = 0; y < 11; y ++)
+    {
+        for(uint32_t x = 0; x < 19; x ++)
+        {
+            const char* p = &pixels[(y*19 + x)*4];
+            char v = gray.merged_image.datas[0].row(y)[x];
+            char a = gray.merged_image.datas[1].row(y)[x];
+            if (p[0] != v || p[1] != v || p[2] != v || p[3] != a)
+                same = false;
+        }
+    }
+    CHECK(same);
+}
+
+// interleave_row gives the same bytes whichever of its vector paths the
+// CPU takes, including the tail after the last whole block.
+static void test_interleave_row()
+{
+    for(unsigned count = 1; count <= 4; count ++)
+    {
+        for(size_t w:{0, 1, 15, 16, 17, 31, 32, 33, 70, 100})
+        {
+            vector<vector<char>> planes(count, vector<char>(w + 1));
+            const char* pointers[4];
+            for(unsigned c = 0; c < count; c ++)
+            {
+                for(auto& v:planes[c])
+                    v = (char)rng();
+                pointers[c] = planes[c].data();
+            }
+            vector<char> out(w*count + 1, 0x55);
+            psd::interleave_row(pointers, count, w, 1, out.data());
+            bool same = out[w*count] == 0x55;
+            for(size_t x = 0; x < w; x ++)
+                for(unsigned c = 0; c < count; c ++)
+                    if (out[x*count + c] != planes[c][x])
+                        same = false;
+            CHECK(same);
+        }
+    }
+}
+
+static psd::Layer solid_layer(int32_t left, uint32_t w, uint32_t h, const uint8_t (&rgba)[4], bool clipped)
+{
+    psd::Layer layer = make_layer(left, 0, w, h, 8, Fill::Flat);
+    layer.clipping = clipped;
+    for(size_t c = 0; c < layer.channel_infos.size(); c ++)
+    {
+        int16_t id = layer.channel_infos[c].first;
+        psd::Plane& plane = layer.channel_info_data[c].data;
+        for(uint32_t y = 0; y < h; y ++)
+            memset(plane.row(y), rgba[id == -1 ? 3 : id], w);
+    }
+    return layer;
+}
+
+// A group record: 3 opens it (below its children), 1 closes it.
+static psd::Layer section_layer(uint32_t type)
+{
+    psd::Layer layer;
+    layer.top = layer.left = layer.bottom = layer.right = 0;
+    layer.blend_signature = psd::Signature("8BIM");
+    layer.blend_key = 0x6e6f726d; // norm
+    layer.opacity = 255;
+    layer.clipping = 0;
+    layer.bit_flags = 0;
+    layer.dummy1 = 0;
+    layer.mask.length = 0;
+    layer.num_channels = 0;
+    layer.name = "group";
+    psd::ExtraData extra;
+    extra.signature = psd::Signature("8BIM");
+    extra.key = psd::Signature("lsct");
+    std::vector<char> data(12);
+    psd::be<uint32_t> be_type = type, blend = 0x70617373; // pass
+    memcpy(&data[0], &be_type, 4);
+    memcpy(&data[4], "8BIM", 4);
+    memcpy(&data[8], &blend, 4);
+    extra.data.assign(std::move(data));
+    extra.length = 12;
+    layer.additional_extra_data.push_back(std::move(extra));
+    return layer;
+}
+
+// A layer clipped to a group is clipped to what the group composites to,
+// not composited on its own.
+static void test_clip_to_group()
+{
+    const uint8_t red[4] = {255, 0, 0, 255}, blue[4] = {0, 0, 255, 255};
+    psd::psd doc = make_document(8, 4, 8, Fill::Flat);
+    doc.layers().push_back(section_layer(3));
+    doc.layers().push_back(solid_layer(0, 3, 4, red, false));
+    doc.layers().push_back(section_layer(1));
+    doc.layers().push_back(solid_layer(0, 8, 4, blue, true));
+    doc.layer_info.num_layers = doc.layers().size();
+
+    psd::psd loaded;
+    CHECK(load(loaded, save(doc, true)));
+    vector<uint8_t> pixels(8*4*4);
+    CHECK(loaded.composite((char*)pixels.data(), 8*4));
+    bool clipped = true;
+    for(uint32_t y = 0; y < 4; y ++)
+    {
+        for(uint32_t x = 0; x < 8; x ++)
+        {
+            const uint8_t* p = &pixels[(y*8 + x)*4];
+            if (x < 3 ? memcmp(p, blue, 4) != 0 : p[3] != 0)
+                clipped = false;
+        }
+    }
+    CHECK(clipped);
+}
+
+// PSB documents (header.version 2) take the same seekable and buffered
+// paths as PSD at 8 and 16 bit, and a lazily loaded PSB saved as PSD
+// rewrites the row length tables of the payloads it passes through.
+static void test_psb()
+{
+    for(uint16_t bit_depth:{8, 16})
+    {
+        psd::psd doc = make_document(70, 50, bit_depth, Fill::Flat);
+        add_layers(doc);
+        doc.header.version = 2;
+        // repeat one byte, as flat 16 bit samples have no byte runs
+        for(auto& plane:doc.merged_image.datas)
+            for(uint32_t y = 0; y < plane.height(); y ++)
+                memset(plane.row(y), 0x5a, plane.row_bytes());
+        string seekable = save(doc, true);
+        CHECK(seekable == save(doc, false));
+        psd::SaveOptions options;
+        options.threads = 3;
+        CHECK(save(doc, true, options) == seekable);
+        CHECK(save(doc, false, options) == seekable);
+        CHECK(seekable.compare(0, 6, string("8BPS\0\2", 6)) == 0);
+
+        psd::psd loaded;
+        CHECK(load(loaded, seekable));
+        CHECK(loaded.header.version == 2);
+        CHECK(loaded.merged_image.compression_method == 1);
+        CHECK(same_layers(loaded, doc));
+        for(int c = 0; c < 3; c ++)
+            CHECK(same_planes(loaded.merged_image.datas[c], doc.merged_image.datas[c]));
+        CHECK(save(loaded, true) == seekable);
+
+        psd::LoadOptions lazy;
+        lazy.lazy = true;
+        psd::psd passed;
+        CHECK(load(passed, seekable, lazy));
+        CHECK(!passed.merged_image.decoded && passed.merged_image.compression_method == 1);
+        passed.header.version = 1;
+        doc.header.version = 1;
+        string expected = save(doc, true);
+        CHECK(save(passed, true) == expected);
+        CHECK(save(passed, false) == expected);
+        psd::psd reloaded;
+        CHECK(load(reloaded, expected));
+        CHECK(same_layers(reloaded, doc));
+    }
+}
+
+// Channels loaded tiled, serially or on several threads, hold the pixels
+// of an untiled load, interleave to the same bytes and save back to the
+// input. The layers mix flat areas, which become constant tiles, with
+// noise, and their edges do not fall on tile boundaries.
+static void test_tiled()
+{
+    for(uint16_t bit_depth:{8, 16})
+    {
+        psd::psd doc = make_document(150, 100, bit_depth, Fill::Flat);
+        doc.layers().push_back(make_layer(-5, 3, 150, 97, bit_depth, Fill::Flat));
+        psd::Layer patchy = make_layer(10, 0, 140, 100, bit_depth, Fill::Noise);
+        for(auto& channel:patchy.channel_info_data)
+        {
+            // zero all but a band across the middle tile row
+            for(uint32_t y = 0; y < channel.h; y ++)
+                if (y < 64 || y >= 90)
+                    memset(channel.data.row(y), 0, channel.data.row_bytes());
+        }
+        doc.layers().push_back(std::move(patchy));
+        doc.layer_info.num_layers = doc.layers().size();
+        string bytes = save(doc, true);
+
+        psd::psd untiled;
+        CHECK(load(untiled, bytes));
+        for(unsigned threads:{1u, 4u})
+        {
+            psd::LoadOptions options;
+            options.tiled = true;
+            options.threads = threads;
+            psd::psd tiled;
+            CHECK(load(tiled, bytes, options));
+            CHECK(tiled.layers().size() == 2);
+            if (tiled.layers().size() != 2)
+                continue;
+            size_t constant = 0;
+            for(size_t i = 0; i < 2; i ++)
+            {
+                psd::Layer& l = tiled.layers()[i];
+                for(size_t c = 0; c < l.channel_info_data.size(); c ++)
+                {
+                    psd::ImageData& id = l.channel_info_data[c];
+                    CHECK(id.tiled());
+                    constant += id.tiles.tiles_x()*id.tiles.tiles_y() - id.tiles.stored_tiles();
+                    psd::Plane plane;
+                    id.tiles.to_plane(plane);
+                    CHECK(same_planes(plane, untiled.layers()[i].channel_info_data[c].data));
+                }
+                psd::Layer& u = untiled.layers()[i];
+                size_t stride = (size_t)l.channel_info_data[0].w*4*bit_depth/8;
+                vector<char> a(stride*l.channel_info_data[0].h), b(a.size());
+                CHECK(l.interleave(psd::PixelFormat::RGBA, a.data(), stride));
+                CHECK(u.interleave(psd::PixelFormat::RGBA, b.data(), stride));
+                CHECK(a == b);
+            }
+            CHECK(constant > 0);
+            CHECK(save(tiled, true) == bytes);
+            CHECK(save(tiled, false) == bytes);
+        }
+    }
+}
+
+static bool same_as_composite(psd::psd& doc, const psd::Compositor& compositor, const psd::CompositeOptions& options)
+{
+    uint32_t w = doc.header.width, h = doc.header.height;
+    psd::Plane expected;
+    expected.allocate((size_t)w*4, h);
+    if (!doc.composite(expected.row(0), expected.stride(), options))
+        return false;
+    return same_planes(compositor.pixels(), expected);
+}
+
+// After moving a layer, fading a group, hiding a layer or painting into a
+// channel, invalidating what changed and updating gives what a fresh
+// composite does, whatever the tile size and thread count.
+static void test_compositor()
+{
+    psd::psd doc = make_document(150, 110, 8, Fill::Gradient);
+    doc.layers().push_back(make_layer(0, 0, 150, 110, 8, Fill::Gradient));
+    doc.layers().push_back(section_layer(3));
+    doc.layers().push_back(make_layer(20, 15, 70, 60, 8, Fill::Noise));
+    doc.layers().push_back(make_layer(60, 40, 80, 50, 8, Fill::Noise));
+    doc.layers().back().blend_key = 0x6d756c20; // mul
+    doc.layers().push_back(section_layer(1));
+    doc.layers().push_back(make_layer(-10, 70, 50, 60, 8, Fill::Noise));
+    doc.layer_info.num_layers = doc.layers().size();
+    string bytes = save(doc, true);
+
+    for(uint32_t tile_size:{16u, 37u, 128u})
+    {
+        for(unsigned threads:{1u, 3u})
+        {
+            psd::psd loaded;
+            CHECK(load(loaded, bytes));
+            psd::CompositeOptions options;
+            options.tile_size = tile_size;
+            options.threads = threads;
+            psd::Compositor compositor(loaded, options);
+            CHECK(compositor.update());
+            CHECK(same_as_composite(loaded, compositor, options));
+
+            psd::Layer& moved = loaded.layers()[2];
+            moved.left += 31;
+            moved.right += 31;
+            moved.top -= 9;
+            moved.bottom -= 9;
+            compositor.invalidate_layer(2);
+            CHECK(compositor.update());
+            CHECK(same_as_composite(loaded, compositor, options));
+
+            loaded.layers()[4].opacity = 100;
+            compositor.invalidate_layer(4);
+            CHECK(compositor.update());
+            CHECK(same_as_composite(loaded, compositor, options));
+
+            loaded.layers()[5].bit_flags |= 2;
+            compositor.invalidate_layer(5);
+            CHECK(compositor.update());
+            CHECK(same_as_composite(loaded, compositor, options));
+
+            // repaint a band of the bottom layer's red channel
+            psd::ImageData* red = loaded.layers()[0].get_channel_info_by_id(0);
+            for(uint32_t y = 50; y < 58; y ++)
+                memset(red->data.row(y) + 40, 0, 30);
+            compositor.invalidate(40, 50, 30, 8);
+            CHECK(compositor.update());
+            CHECK(same_as_composite(loaded, compositor, options));
+        }
+    }
+}
+
+static psd::Layer named(psd::Layer layer, const char* name)
+{
+    layer.name = name;
+    return layer;
+}
+
+// Paths find layers and nested groups, the topmost of equal siblings
+// first. A subtree load decodes only that subtree, fails on a missing
+// path and saves back to the input, and composite_subtree gives what it
+// does on the fully loaded document. At 16 bit the layers sit in an Lr16
+// block.
+static void test_subtree()
+{
+    for(uint16_t bit_depth:{8, 16})
+    {
+        psd::psd doc = make_document(90, 70, bit_depth, Fill::Gradient);
+        doc.layers().push_back(named(make_layer(0, 0, 90, 70, bit_depth, Fill::Gradient), "bg"));
+        doc.layers().push_back(section_layer(3));
+        doc.layers().push_back(named(make_layer(5, 5, 40, 30, bit_depth, Fill::Noise), "a"));
+        doc.layers().push_back(section_layer(3));
+        doc.layers().push_back(named(make_layer(30, 20, 50, 45, bit_depth, Fill::Noise), "b"));
+        doc.layers().push_back(named(section_layer(1), "inner"));
+        doc.layers().push_back(named(section_layer(1), "outer"));
+        doc.layers().push_back(named(make_layer(60, 0, 20, 20, bit_depth, Fill::Flat), "top"));
+        doc.layers().push_back(named(make_layer(0, 50, 20, 20, bit_depth, Fill::Flat), "top"));
+        doc.layer_info.num_layers = doc.layers().size();
+        string bytes = save(doc, true);
+
+        psd::psd full;
+        CHECK(load(full, bytes));
+        psd::LayerTree& tree = full.layer_info.tree;
+        CHECK(tree.nodes.size() == 9);
+        if (tree.nodes.size() != 9)
+            continue;
+        CHECK(tree.roots == vector<size_t>({0, 6, 7, 8}));
+        CHECK(tree.is_group(6) && tree.is_group(5) && !tree.is_group(4));
+        CHECK(tree.nodes[6].first == 1 && tree.nodes[5].first == 3);
+        CHECK(tree.nodes[6].children == vector<size_t>({2, 5}));
+        CHECK(tree.nodes[4].parent == 5 && tree.nodes[5].parent == 6 && tree.nodes[0].parent == -1);
+        CHECK(tree.find(full.layers(), "outer") == 6);
+        CHECK(tree.find(full.layers(), "outer/a") == 2);
+        CHECK(tree.find(full.layers(), "outer/inner") == 5);
+        CHECK(tree.find(full.layers(), "outer/inner/b") == 4);
+        CHECK(tree.find(full.layers(), "top") == 8);
+        CHECK(tree.find(full.layers(), "inner") == -1);
+        CHECK(tree.find(full.layers(), "outer/b") == -1);
+        CHECK(tree.find(full.layers(), "outer/inner/b/c") == -1);
+
+        psd::LoadOptions options;
+        options.subtree = "outer/nothing";
+        psd::psd missing;
+        CHECK(!load(missing, bytes, options));
+
+        options.subtree = "outer/inner";
+        psd::psd part;
+        CHECK(load(part, bytes, options));
+        CHECK(part.layers().size() == 9);
+        if (part.layers().size() != 9)
+            continue;
+        CHECK(part.layers()[4].channel_info_data[0].decoded);
+        CHECK(!part.layers()[2].channel_info_data[0].decoded);
+        CHECK(!part.merged_image.decoded);
+        CHECK(save(part, true) == bytes);
+        CHECK(save(part, false) == bytes);
+
+        for(size_t index:{4, 5})
+        {
+            psd::Plane a, b;
+            uint32_t a_left = 0, a_top = 0, b_left = 1, b_top = 1;
+            CHECK(part.composite_subtree(index, a, a_left, a_top));
+            CHECK(full.composite_subtree(index, b, b_left, b_top));
+            CHECK(a_left == b_left && a_top == b_top);
+            CHECK(same_planes(a, b));
+        }
+    }
+}
+
+static void decode_all(psd::psd& doc)
+{
+    for(auto& layer:doc.layers())
+        for(auto& channel:layer.channel_info_data)
+            CHECK(channel.decode());
+    CHECK(doc.merged_image.decode());
+}
+
+// A lazily loaded document keeps the payloads as they were, as copies from
+// a stream and as views from memory with an owner: saving it gives the
+// input back, and decoding it later gives what an eager load does.
+static void test_lazy()
+{
+    psd::psd doc = make_document(80, 60, 8, Fill::Gradient);
+    add_layers(doc);
+    string bytes = save(doc, true);
+    psd::psd eager;
+    CHECK(load(eager, bytes));
+
+    for(bool view:{false, true})
+    {
+        psd::LoadOptions options;
+        options.lazy = true;
+        psd::psd lazy;
+        if (view)
+        {
+            auto owner = make_shared<string>(bytes);
+            psd::ByteReader reader(owner->data(), owner->size(), owner);
+            CHECK(lazy.load(reader, options));
+        }
+        else
+        {
+            CHECK(load(lazy, bytes, options));
+        }
+        CHECK(lazy.layers().size() == 3);
+        if (lazy.layers().size() != 3)
+            continue;
+        psd::ImageData& channel = lazy.layers()[0].channel_info_data[0];
+        CHECK(!channel.decoded && channel.packed.is_view() == view);
+        CHECK(!lazy.merged_image.decoded);
+        CHECK(save(lazy, true) == bytes);
+        CHECK(save(lazy, false) == bytes);
+
+        decode_all(lazy);
+        CHECK(channel.decoded);
+        for(size_t i = 0; i < 3; i ++)
+            for(size_t c = 0; c < lazy.layers()[i].channel_info_data.size(); c ++)
+                CHECK(same_planes(lazy.layers()[i].channel_info_data[c].data, eager.layers()[i].channel_info_data[c].data));
+        for(int c = 0; c < 3; c ++)
+            CHECK(same_planes(lazy.merged_image.datas[c], eager.merged_image.datas[c]));
+        CHECK(save(lazy, true) == bytes);
+    }
+}
+
+template <typename T>
+static bool same_as_box_filter(const psd::Plane& full, uint32_t w, uint32_t h, unsigned shift, const psd::Plane& scaled)
+{
+    uint32_t box = 1u << shift;
+    uint32_t out_w = (w + box - 1) >> shift, out_h = (h + box - 1) >> shift;
+    if (scaled.row_bytes() != out_w*sizeof(T) || scaled.height() != out_h)
+        return false;
+    for(uint32_t oy = 0; oy < out_h; oy ++)
+    {
+        for(uint32_t ox = 0; ox < out_w; ox ++)
+        {
+            uint64_t sum = 0, n = 0;
+            for(uint32_t y = oy*box; y < min(h, (oy + 1)*box); y ++)
+            {
+                for(uint32_t x = ox*box; x < min(w, (ox + 1)*box); x ++)
+                {
+                    T v;
+                    memcpy(&v, full.row(y) + x*sizeof(T), sizeof(T));
+                    sum += v;
+                    n ++;
+                }
+            }
+            T got;
+            memcpy(&got, scaled.row(oy) + ox*sizeof(T), sizeof(T));
+            if (got != (T)((sum + n/2)/n))
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool same_as_box_filter(uint16_t bit_depth, const psd::Plane& full, uint32_t w, uint32_t h, unsigned shift, const psd::Plane& scaled)
+{
+    if (bit_depth == 16)
+        return same_as_box_filter<uint16_t>(full, w, h, shift, scaled);
+    return same_as_box_filter<uint8_t>(full, w, h, shift, scaled);
+}
+
+// decode_scaled of layer channels and of the merged image, decoded or
+// straight from raw and PackBits payloads, averages each box like a plain
+// box filter, including the partial boxes along odd edges.
+static void test_decode_scaled()
+{
+    for(uint16_t bit_depth:{8, 16})
+    {
+        uint32_t w = 77, h = 53;
+        psd::psd doc = make_document(w, h, bit_depth, Fill::Noise);
+        // a flat right half makes the merged image PackBits
+        for(auto& plane:doc.merged_image.datas)
+            for(uint32_t y = 0; y < h; y ++)
+                memset(plane.row(y) + plane.row_bytes()/2, 0x33, plane.row_bytes() - plane.row_bytes()/2);
+        doc.layers().push_back(make_layer(3, 2, 45, 29, bit_depth, Fill::Noise));
+        doc.layer_info.num_layers = 1;
+        string bytes = save(doc, true);
+
+        for(bool lazy:{false, true})
+        {
+            psd::LoadOptions options;
+            options.lazy = lazy;
+            psd::psd loaded;
+            CHECK(load(loaded, bytes, options));
+            CHECK(loaded.merged_image.compression_method == 1);
+            CHECK(loaded.merged_image.decoded == !lazy);
+            psd::ThreadPool pool(3);
+            for(unsigned shift:{0u, 1u, 3u})
+            {
+                for(psd::ThreadPool* p:{(psd::ThreadPool*)nullptr, &pool})
+                {
+                    vector<psd::Plane> merged;
+                    CHECK(loaded.merged_image.decode_scaled(shift, merged, p));
+                    CHECK(merged.size() == 3);
+                    for(size_t c = 0; c < merged.size(); c ++)
+                        CHECK(same_as_box_filter(bit_depth, doc.merged_image.datas[c], w, h, shift, merged[c]));
+                }
+                for(int16_t id = -1; id < 3; id ++)
+                {
+                    psd::Plane scaled;
+                    CHECK(loaded.layers()[0].decode_scaled(id, shift, scaled));
+                    CHECK(same_as_box_filter(bit_depth, doc.layers()[0].get_channel_info_by_id(id)->data, 45, 29, shift, scaled));
+                }
+            }
+        }
+    }
+}
+
+// Loading through the std::istream adapter gives what loading from memory
+// does, with the default 1 MiB chunks and with small ones, for channels
+// larger than a chunk that are read past it straight into place, rows that
+// straddle chunk boundaries and an empty layer with zero length payloads.
+static void test_stream_chunks()
+{
+    psd::psd doc = make_document(40, 30, 8, Fill::Gradient);
+    doc.layers().push_back(make_layer(0, 0, 1100, 1000, 8, Fill::Noise));
+    doc.layers().push_back(make_layer(5, 5, 0, 0, 8, Fill::Flat));
+    doc.layers().push_back(make_layer(2, 3, 300, 200, 8, Fill::Gradient));
+    doc.layer_info.num_layers = doc.layers().size();
+    string bytes = save(doc, true);
+    CHECK(bytes.size() > 4 << 20);
+
+    psd::psd from_memory;
+    psd::ByteReader span(bytes.data(), bytes.size());
+    CHECK(from_memory.load(span));
+    CHECK(same_layers(from_memory, doc));
+    for(size_t chunk_size:{(size_t)1 << 20, (size_t)4096, (size_t)1000})
+    {
+        istringstream in(bytes);
+        psd::ByteReader reader(in, chunk_size);
+        psd::psd loaded;
+        CHECK(loaded.load(reader));
+        CHECK(same_layers(loaded, from_memory));
+        for(int c = 0; c < 3; c ++)
+            CHECK(same_planes(loaded.merged_image.datas[c], from_memory.merged_image.datas[c]));
+        CHECK(save(loaded, true) == bytes);
+    }
+}
+
+// A mapped load gives the layers and merged image of a stream load, eagerly
+// and lazily, with the lazy payloads referring to the mapping.
+static void test_load_mapped()
+{
+    psd::psd doc = make_document(60, 45, 8, Fill::Gradient);
+    add_layers(doc);
+    doc.layers()[1].name = "second";
+    string bytes = save(doc, true);
+    const char* path = "roundtrip_test_mapped.psd";
+    {
+        ofstream out(path, ios::binary);
+        out.write(bytes.data(), bytes.size());
+    }
+
+    psd::psd streamed;
+    CHECK(load(streamed, bytes));
+    for(bool lazy:{false, true})
+    {
+        psd::LoadOptions options;
+        options.lazy = lazy;
+        psd::psd mapped;
+        CHECK(mapped.load_mapped(path, options));
+        CHECK(mapped.layers().size() == streamed.layers().size());
+        if (mapped.layers().size() != streamed.layers().size())
+            continue;
+        for(size_t i = 0; i < mapped.layers().size(); i ++)
+            CHECK(mapped.layers()[i].utf8name == streamed.layers()[i].utf8name);
+        if (lazy)
+            CHECK(mapped.layers()[0].channel_info_data[0].packed.is_view());
+        CHECK(same_layers(mapped, streamed));
+        CHECK(mapped.merged_image.decode());
+        for(int c = 0; c < 3; c ++)
+            CHECK(same_planes(mapped.merged_image.datas[c], streamed.merged_image.datas[c]));
+        CHECK(save(mapped, true) == bytes);
+    }
+    remove(path);
+    psd::psd missing;
+    CHECK(!missing.load_mapped(path));
+}
+
+// scan and scan_mapped give the layer records of a full load, names,
+// bounds and channel lengths included, without any channel data or merged
+// image, and refuse to save.
+static void test_scan()
+{
+    for(uint16_t bit_depth:{8, 16})
+    {
+        psd::psd doc = make_document(50, 40, bit_depth, Fill::Gradient);
+        add_layers(doc);
+        doc.layers()[2].name = "third";
+        string bytes = save(doc, true);
+        const char* path = "roundtrip_test_scan.psd";
+        {
+            ofstream out(path, ios::binary);
+            out.write(bytes.data(), bytes.size());
+        }
+        psd::psd full;
+        CHECK(load(full, bytes));
+
+        for(bool mapped:{false, true})
+        {
+            psd::psd scanned;
+            istringstream in(bytes);
+            CHECK(mapped ? scanned.scan_mapped(path) : scanned.scan(in));
+            CHECK(scanned.layers().size() == full.layers().size());
+            if (scanned.layers().size() != full.layers().size())
+                continue;
+            for(size_t i = 0; i < full.layers().size(); i ++)
+            {
+                const psd::Layer& a = scanned.layers()[i];
+                const psd::Layer& b = full.layers()[i];
+                CHECK(a.utf8name == b.utf8name);
+                CHECK(a.left == b.left && a.top == b.top && a.right == b.right && a.bottom == b.bottom);
+                CHECK(a.channel_infos == b.channel_infos);
+                CHECK(a.channel_info_data.empty());
+            }
+            CHECK(!scanned.merged_image.decoded && scanned.merged_image.datas.empty());
+            ostringstream out;
+            CHECK(!scanned.save(out));
+        }
+        remove(path);
+    }
+}
+
+int main()
+{
+    test_merged_image();
+    test_parallel_save();
+    test_deep_layers();
+    test_long_rows();
+    test_zip();
+    test_mask_regions();
+    test_interleave_color_mode();
+    test_interleave_row();
+    test_clip_to_group();
+    test_psb();
+    test_tiled();
+    test_compositor();
+    test_subtree();
+    test_lazy();
+    test_decode_scaled();
+    test_stream_chunks();
+    test_load_mapped();
+    test_scan();
+    if (failures)
+        cout << failures << " checks failed" << endl;
+    else
+        cout << "OK" << endl;
+    return failures;
+}